@@ -20,10 +20,13 @@
  */
 //=======================================================================
 #include "plugin.hpp"
-#include "dep/lodepng/lodepng.h"
 #include "osdialog.h"
-#include <iostream>
 #include "pictogramtools.hpp"
+#include "imageloader.hpp"
+#include "spectrogram.hpp"
+#include "voltagetable.hpp"
+#include <climits>
+#include <cstdlib>
 
 struct Pictogram : Module
 {
@@ -31,12 +34,18 @@ struct Pictogram : Module
   {
     SCALE_PARAM,
     OFFSET_PARAM,
+    RATE_PARAM,
     PARAMS_LEN
   };
   enum InputId
   {
     RESET_INPUT,
     CLOCK_INPUT,
+    X_INPUT,
+    Y_INPUT,
+    VOCT_INPUT,
+    WAVE_INPUT,
+    FRAME_INPUT,
     INPUTS_LEN
   };
   enum OutputId
@@ -53,103 +62,331 @@ struct Pictogram : Module
   {
     LIGHTS_LEN
   };
+  // What the channels of a polyphonic output carry
+  enum PolyMode
+  {
+    POLY_PIXELS, // Consecutive pixels of the select box
+    POLY_ROWS,   // The same column of consecutive rows
+    POLY_MODES_LEN
+  };
+  // What the frame input does with an animation
+  enum FrameMode
+  {
+    FRAME_ADVANCE,  // Next frame at every trigger
+    FRAME_POSITION, // 0V to 10V pick the frame
+    FRAME_MODES_LEN
+  };
 
   std::string imagePath{};
   dsp::SchmittTrigger sTrigClock{};
   dsp::SchmittTrigger sTrigReset{};
-  thm::ColorSpace clrSpace{};
   thm::RGBData rgbData{};
+  thm::Rect selectBox{}; // Select box in image pixels, GUI side copy
   thm::Rect slctView{};
-  bool loading{false};
-  bool hasLoadedImage{false};
   bool existJsonData{false};
-  unsigned image_width{};
-  unsigned image_height{};
+  int channels{1};
+  int polyMode{POLY_PIXELS};
+  int scanOrder{thm::SCAN_ROWS};
+  uint32_t scanSeed{1};
+  int interpolation{thm::INTERP_BILINEAR};
+  // Index into averageRadius(), 0 reads single pixels
+  enum { AVERAGES_LEN = 7 };
+  int averaging{0};
+  int waveSource{thm::WAVES_OFF};
+  float phases[PORT_MAX_CHANNELS]{};
+  bool spectrogram{false};
+  thm::SpectralSynth synth{};
+  // What process() runs, chosen once per control block
+  enum Engine
+  {
+    ENGINE_CLOCK,
+    ENGINE_XY,
+    ENGINE_WAVES,
+    ENGINE_SPECTRUM
+  };
+  enum { CONTROL_BLOCK = 32 };
+  dsp::ClockDivider controlDivider{};
+  int engine{ENGINE_CLOCK};
+  int outChannels{1};
+  float gain{}, bias{};         // Output = plane value * gain + bias
+  float gainStep{}, biasStep{}; // Ramps to the knobs over a block
+  float frameStep{};            // Spectrogram columns per sample
+  alignas(16) float frame[thm::Image::PLANES][PORT_MAX_CHANNELS]{};
+  int curve{thm::CURVE_LINEAR};
+  // Quantizer: one scale and key, switched on output by output
+  int quantScale{thm::SCALE_MAJOR};
+  int quantKey{0};
+  bool quantized[thm::Image::PLANES]{};
+  thm::VoltageTable voltageTables[thm::Image::PLANES]{};
+  bool tabled[thm::Image::PLANES]{}; // Outputs that read their table this block
+  // Animations. Unpatched they play on their own, at the delays of
+  // an APNG or at the rate knob for the frames of a folder.
+  int frameMode{FRAME_ADVANCE};
+  const thm::FrameSet *frameSet{nullptr};
+  unsigned frameLayout{0}; // Of frameSet, the loader may free it once another is acquired
+  unsigned shownFrame{0};
+  float frameTime{0.f};  // Seconds the frame is shown
+  float frameDelay{1.f}; // Seconds it lasts
+  dsp::SchmittTrigger sTrigFrame{};
+  std::atomic<unsigned> displayFrame{0}; // For the display
+  thm::ImageLoader loader{};
 
   Pictogram()
   {
     config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
     configParam(SCALE_PARAM, 1.f, 10.f, 1.f, "Scale", " V");
     configParam(OFFSET_PARAM, -5.f, 5.f, 0.5f, "Offset", " V");
+    configParam(RATE_PARAM, -3.f, 9.f, 3.f, "Spectrogram and image folder frame rate", " frames/s", 2.f);
     configInput(RESET_INPUT, "Reset");
     configInput(CLOCK_INPUT, "Clock");
+    configInput(X_INPUT, "X position in the select box, 0V to 10V");
+    configInput(Y_INPUT, "Y position in the select box, 0V to 10V");
+    configInput(VOCT_INPUT, "1V/octave pitch");
+    configInput(WAVE_INPUT, "Wave position, 0V to 10V");
+    configInput(FRAME_INPUT, "Animation frame");
     configOutput(RED_OUTPUT, "Red");
     configOutput(GREEN_OUTPUT, "Green");
     configOutput(BLUE_OUTPUT, "Blue");
     configOutput(HUE_OUTPUT, "Hue");
     configOutput(SAT_OUTPUT, "Saturation");
     configOutput(LUM_OUTPUT, "Luminance");
+    controlDivider.setDivision(CONTROL_BLOCK);
   }
   void process(const ProcessArgs& args) override
   {
+    if (controlDivider.process())
+      control(args);
+    if (frameSet && frameSet->count > 1)
+      stepFrame(args);
     if (rgbData.isEmpty())
       return;
-    if (sTrigReset.process(inputs[RESET_INPUT].getVoltage()))
-      rgbData.resetPosition();
-    if (!sTrigClock.process(inputs[CLOCK_INPUT].getVoltage()))
+    gain += gainStep;
+    bias += biasStep;
+    const thm::ScanPath &path = *rgbData.getPath();
+    float values[thm::Image::PLANES];
+    // A frame shown within the block may have no wave bank
+    int active = engine == ENGINE_WAVES && path.waveCount == 0 ? ENGINE_CLOCK : engine;
+    switch (active)
+    {
+    case ENGINE_WAVES:
+      // Oscillator: the rows or columns of the box are the wave cycles
+      for (int c = 0; c < outChannels; c++)
+      {
+        float pitch = clamp(inputs[VOCT_INPUT].getPolyVoltage(c), -10.f, 10.f);
+        float freq = std::min(dsp::FREQ_C4 * dsp::exp2_taylor5(pitch), args.sampleRate / 2.f);
+        phases[c] += freq * args.sampleTime;
+        phases[c] -= std::floor(phases[c]);
+        float position = inputs[WAVE_INPUT].getPolyVoltage(c) / 10.f;
+        thm::sampleWaves(path, phases[c], position, thm::waveLevel(freq, args.sampleRate), values);
+        setFrame(c, values);
+      }
+      break;
+    case ENGINE_SPECTRUM:
+      // The clock, or else the rate knob, moves through the columns
+      if (sTrigReset.process(inputs[RESET_INPUT].getVoltage()))
+        synth.reset();
+      if (!inputs[CLOCK_INPUT].isConnected())
+        synth.advance(frameStep);
+      else if (sTrigClock.process(inputs[CLOCK_INPUT].getVoltage()))
+        synth.advance(1.f);
+      synth.process(path, values);
+      // Audio around the middle of the plane range
+      for (float &value : values)
+        value = 0.5f + 0.5f * value;
+      setFrame(0, values);
+      break;
+    case ENGINE_XY:
+      // X/Y CV reads the box anywhere, every sample, instead of the clock
+      for (int c = 0; c < outChannels; c++)
+      {
+        float x = inputs[X_INPUT].getPolyVoltage(c) / 10.f;
+        float y = inputs[Y_INPUT].getPolyVoltage(c) / 10.f;
+        thm::samplePlanes(path, x, y, interpolation, values);
+        setFrame(c, values);
+      }
+      break;
+    default:
+      // Between clock edges the outputs hold their voltages
+      if (sTrigReset.process(inputs[RESET_INPUT].getVoltage()))
+        rgbData.resetPosition();
+      if (!sTrigClock.process(inputs[CLOCK_INPUT].getVoltage()))
+        return;
+      // The loader precomputed the planes in output order
+      uint radius = averageRadius();
+      for (int c = 0; c < outChannels; c++)
+      {
+        uint row = polyMode == POLY_ROWS ? c : 0;
+        if (radius)
+          thm::averagePlanes(path, rgbData.getIndex(row), radius, values);
+        else
+          for (int p = 0; p < thm::Image::PLANES; p++)
+            values[p] = rgbData.getPlane(p, row);
+        setFrame(c, values);
+        if (polyMode == POLY_PIXELS)
+          rgbData.nextPixel();
+      }
+      if (polyMode == POLY_ROWS)
+        rgbData.nextPixel();
+    }
+    writeOutputs();
+  }
+  // Once per control block: pick up the path over a new image, box or
+  // frame, the engine, the channels and the scale and offset
+  void control(const ProcessArgs &args)
+  {
+    // The previous set must not be read from here on
+    const thm::FrameSet *set = loader.acquire();
+    if (set != frameSet)
+    {
+      // Other frames of the same layout go on where the scan was
+      bool sameLayout = frameSet && set && set->layout == frameLayout;
+      frameSet = set;
+      frameLayout = set ? set->layout : 0;
+      if (set)
+        shownFrame %= set->count;
+      const thm::ScanPath *path = set ? set->get(shownFrame) : nullptr;
+      if (sameLayout)
+        rgbData.setFrame(path);
+      else
+        rgbData.setPath(path);
+    }
+    if (frameSet && frameSet->count > 1)
+    {
+      unsigned count = frameSet->count;
+      if (frameMode == FRAME_POSITION && inputs[FRAME_INPUT].isConnected())
+      {
+        float position = clamp(inputs[FRAME_INPUT].getVoltage() / 10.f, 0.f, 1.f);
+        unsigned index = std::min(unsigned(position * count), count - 1);
+        if (index != shownFrame)
+          showFrame(index);
+      }
+      if (!frameSet->delays)
+        frameDelay = 1.f / dsp::exp2_taylor5(params[RATE_PARAM].getValue());
+      loader.seek(shownFrame);
+    }
+    if (rgbData.isEmpty())
       return;
-    clrSpace.calc(rgbData.getColor());
-    rgbData.nextPixel();
-    float red = rescale(clrSpace.red, 0.f, 255.f, 0.f, 10.f);
-    float green = rescale(clrSpace.green, 0.f, 255.f, 0.f, 10.f);
-    float blue = rescale(clrSpace.blue, 0.f, 255.f, 0.f, 10.f);
-    float hue = rescale(clrSpace.hue, 0.f, 360.f, 0.f, 10.f);
-    float sat = rescale(clrSpace.sat, 0.f, 1.f, 0.f, 10.f);
-    float lum = rescale(clrSpace.lum, 0.f, 1.f, 0.f, 10.f);
-
+    const thm::ScanPath *path = rgbData.getPath();
+    if (waveSource != thm::WAVES_OFF && path->waveCount > 0)
+    {
+      engine = ENGINE_WAVES;
+      outChannels = std::max(1, inputs[VOCT_INPUT].getChannels());
+    }
+    else if (spectrogram)
+    {
+      engine = ENGINE_SPECTRUM;
+      outChannels = 1;
+      frameStep = dsp::exp2_taylor5(params[RATE_PARAM].getValue()) * args.sampleTime;
+    }
+    else if (inputs[X_INPUT].isConnected() || inputs[Y_INPUT].isConnected())
+    {
+      engine = ENGINE_XY;
+      outChannels = std::max({1, inputs[X_INPUT].getChannels(), inputs[Y_INPUT].getChannels()});
+    }
+    else
+    {
+      engine = ENGINE_CLOCK;
+      outChannels = channels;
+    }
+    for (int i = RED_OUTPUT; i <= LUM_OUTPUT; i++)
+      outputs[i].setChannels(outChannels);
+    // Plane values 0..1 map to offset + scale / 2 down to offset - scale / 2,
+    // reached by the end of the block
     float scale = params[SCALE_PARAM].getValue();
     float offset = params[OFFSET_PARAM].getValue();
-
-    auto transform = [&](float data)
+    gainStep = (-scale - gain) / CONTROL_BLOCK;
+    biasStep = (offset + scale / 2.f - bias) / CONTROL_BLOCK;
+    // Other curves and the quantizer read a table, rebuilt only when
+    // the menu changed it. The knobs glide through gain and bias.
+    for (int p = 0; p < thm::Image::PLANES; p++)
     {
-      float halfscl = scale / 2.f;
-      return rescale(data, 0.f, 10.f, halfscl, -halfscl) + offset;
-    };
-    outputs[RED_OUTPUT].setVoltage(transform(red));
-    outputs[GREEN_OUTPUT].setVoltage(transform(green));
-    outputs[BLUE_OUTPUT].setVoltage(transform(blue));
-    outputs[HUE_OUTPUT].setVoltage(transform(hue));
-    outputs[SAT_OUTPUT].setVoltage(transform(sat));
-    outputs[LUM_OUTPUT].setVoltage(transform(lum));
+      int quantizer = quantized[p] ? quantScale : thm::QUANTIZER_OFF;
+      tabled[p] = curve != thm::CURVE_LINEAR || quantizer != thm::QUANTIZER_OFF;
+      if (tabled[p])
+        voltageTables[p].update(curve, quantizer, quantKey);
+    }
   }
-  void loadSample(std::string path)
+  // Unpatched the frame lasts its delay, else a trigger moves on
+  void stepFrame(const ProcessArgs &args)
   {
-    std::vector<uint8_t> image{};
-    loading = true;
-    rgbData.clear();
-    unsigned error = lodepng::decode(image, image_width, image_height, path, LCT_RGB);
-    if (error != 0)
-    { //Todo: error logging
-      std::cout << "error " << error << ": " << lodepng_error_text(error) << std::endl;
-      imagePath.clear();
-      loading = false;
-      hasLoadedImage = false;
-      return;
+    bool next;
+    if (inputs[FRAME_INPUT].isConnected())
+    {
+      if (frameMode != FRAME_ADVANCE)
+        return;
+      next = sTrigFrame.process(inputs[FRAME_INPUT].getVoltage());
     }
-    //DEBUG(string::f("ThmImageSize: %d", (int)image.size()).c_str());
-    //DEBUG(string::f("ThmImageDim w,h: %d %d", image_width,image_height).c_str());
-    rgbData.reserve(image_width * image_height);
-    uint i = 0;
-    do
+    else
     {
-      rgbData.color.r = image[i++];
-      rgbData.color.g = image[i++];
-      rgbData.color.b = image[i++];
-      rgbData.addColor();
-    } while (i < image.size());
-    rgbData.resetPosition(image_width);
+      frameTime += args.sampleTime;
+      next = frameTime >= frameDelay;
+      if (next)
+        frameTime = std::min(frameTime - frameDelay, frameDelay);
+    }
+    if (next)
+      showFrame((shownFrame + 1) % frameSet->count);
+  }
+  void showFrame(unsigned index)
+  {
+    shownFrame = index;
+    rgbData.setFrame(frameSet->get(index));
+    if (frameSet->delays)
+      frameDelay = (*frameSet->delays)[index];
+    displayFrame = index;
+  }
+  void setFrame(int c, const float values[thm::Image::PLANES])
+  {
+    for (int p = 0; p < thm::Image::PLANES; p++)
+      frame[p][c] = values[p];
+  }
+  // All channels of all outputs in one pass, four channels at a time
+  void writeOutputs()
+  {
+    using simd::float_4;
+    for (int i = RED_OUTPUT; i <= LUM_OUTPUT; i++)
+    {
+      int p = thm::Image::RED + i;
+      if (tabled[p])
+        for (int c = 0; c < outChannels; c++)
+          outputs[i].setVoltage(voltageTables[p].lookup(frame[p][c], gain, bias), c);
+      else
+        for (int c = 0; c < outChannels; c += 4)
+          outputs[i].setVoltageSimd(float_4::load(frame[p] + c) * gain + bias, c);
+    }
+  }
+  // Decoding runs on the loader thread, process() picks up the result
+  void loadSample(std::string path)
+  {
     imagePath = path;
-    loading = false;
-    hasLoadedImage = true;
+    loader.load(path);
+  }
+  // Called by the GUI after moving or resizing the select box
+  void setSelectBox(const thm::Rect &box)
+  {
+    selectBox = box;
+    loader.select(box);
+  }
+  // The loader lays out a new path after the order or the polyphony
+  // changed. Parallel rows step down the box channels rows at a time.
+  void updateScan()
+  {
+    unsigned rowStep = polyMode == POLY_ROWS ? channels : 1;
+    loader.setScan(thm::ScanSettings{scanOrder, scanSeed, rowStep, averaging > 0, waveSource});
+  }
+  // Pixels around each step that are averaged, the last one covers the box
+  uint averageRadius() const
+  {
+    static const uint radii[AVERAGES_LEN] = {0, 1, 2, 4, 8, 16, UINT_MAX};
+    return radii[averaging];
   }
   json_t *dataToJson() override
   {
     json_t *rootJ = json_object();
     json_object_set_new(rootJ, "imagePath", json_string(imagePath.c_str()));
-    json_object_set_new(rootJ, "SelBoxX", json_real(rgbData.selectBox.x));
-    json_object_set_new(rootJ, "SelBoxY", json_real(rgbData.selectBox.y));
-    json_object_set_new(rootJ, "SelBoxW", json_real(rgbData.selectBox.w));
-    json_object_set_new(rootJ, "SelBoxH", json_real(rgbData.selectBox.h));
+    json_object_set_new(rootJ, "SelBoxX", json_real(selectBox.x));
+    json_object_set_new(rootJ, "SelBoxY", json_real(selectBox.y));
+    json_object_set_new(rootJ, "SelBoxW", json_real(selectBox.w));
+    json_object_set_new(rootJ, "SelBoxH", json_real(selectBox.h));
 
     json_object_set_new(rootJ, "SelectViewX", json_real(slctView.x));
     json_object_set_new(rootJ, "SelectViewY", json_real(slctView.y));
@@ -157,6 +394,22 @@ struct Pictogram : Module
     json_object_set_new(rootJ, "SelectViewH", json_real(slctView.h));
 
     json_object_set_new(rootJ, "existJsonData", json_boolean(existJsonData));
+    json_object_set_new(rootJ, "channels", json_integer(channels));
+    json_object_set_new(rootJ, "polyMode", json_integer(polyMode));
+    json_object_set_new(rootJ, "scanOrder", json_integer(scanOrder));
+    json_object_set_new(rootJ, "scanSeed", json_integer(scanSeed));
+    json_object_set_new(rootJ, "interpolation", json_integer(interpolation));
+    json_object_set_new(rootJ, "averaging", json_integer(averaging));
+    json_object_set_new(rootJ, "waveSource", json_integer(waveSource));
+    json_object_set_new(rootJ, "spectrogram", json_boolean(spectrogram));
+    json_object_set_new(rootJ, "curve", json_integer(curve));
+    json_object_set_new(rootJ, "frameMode", json_integer(frameMode));
+    json_object_set_new(rootJ, "quantScale", json_integer(quantScale));
+    json_object_set_new(rootJ, "quantKey", json_integer(quantKey));
+    int quantizedMask = 0;
+    for (int p = 0; p < thm::Image::PLANES; p++)
+      quantizedMask |= quantized[p] << p;
+    json_object_set_new(rootJ, "quantized", json_integer(quantizedMask));
     return rootJ;
   }
   void dataFromJson(json_t *rootJ) override
@@ -166,16 +419,16 @@ struct Pictogram : Module
       loadSample(json_string_value(imagePathJ));
     auto SelBoxX = json_object_get(rootJ, "SelBoxX");
     if(SelBoxX)
-      rgbData.selectBox.x = json_real_value(SelBoxX);
+      selectBox.x = json_real_value(SelBoxX);
     auto SelBoxY = json_object_get(rootJ, "SelBoxY");
     if (SelBoxY)
-      rgbData.selectBox.y = json_real_value(SelBoxY);
+      selectBox.y = json_real_value(SelBoxY);
     auto SelBoxW = json_object_get(rootJ, "SelBoxW");
     if (SelBoxW)
-      rgbData.selectBox.w = json_real_value(SelBoxW);
+      selectBox.w = json_real_value(SelBoxW);
     auto SelBoxH = json_object_get(rootJ, "SelBoxH");
     if (SelBoxH)
-      rgbData.selectBox.h = json_real_value(SelBoxH);
+      selectBox.h = json_real_value(SelBoxH);
 
     auto slctViewX = json_object_get(rootJ, "SelectViewX");
     if (slctViewX)
@@ -195,6 +448,48 @@ struct Pictogram : Module
       existJsonData = json_boolean_value(pExistJsonData);
     else
       existJsonData = false;
+    auto channelsJ = json_object_get(rootJ, "channels");
+    if (channelsJ)
+      channels = clamp((int)json_integer_value(channelsJ), 1, PORT_MAX_CHANNELS);
+    auto polyModeJ = json_object_get(rootJ, "polyMode");
+    if (polyModeJ)
+      polyMode = clamp((int)json_integer_value(polyModeJ), 0, POLY_MODES_LEN - 1);
+    auto scanOrderJ = json_object_get(rootJ, "scanOrder");
+    if (scanOrderJ)
+      scanOrder = clamp((int)json_integer_value(scanOrderJ), 0, thm::SCAN_ORDERS_LEN - 1);
+    auto scanSeedJ = json_object_get(rootJ, "scanSeed");
+    if (scanSeedJ)
+      scanSeed = (uint32_t)json_integer_value(scanSeedJ);
+    auto interpolationJ = json_object_get(rootJ, "interpolation");
+    if (interpolationJ)
+      interpolation = clamp((int)json_integer_value(interpolationJ), 0, thm::INTERPOLATIONS_LEN - 1);
+    auto averagingJ = json_object_get(rootJ, "averaging");
+    if (averagingJ)
+      averaging = clamp((int)json_integer_value(averagingJ), 0, AVERAGES_LEN - 1);
+    auto waveSourceJ = json_object_get(rootJ, "waveSource");
+    if (waveSourceJ)
+      waveSource = clamp((int)json_integer_value(waveSourceJ), 0, thm::WAVE_SOURCES_LEN - 1);
+    auto spectrogramJ = json_object_get(rootJ, "spectrogram");
+    if (spectrogramJ)
+      spectrogram = json_boolean_value(spectrogramJ);
+    auto curveJ = json_object_get(rootJ, "curve");
+    if (curveJ)
+      curve = clamp((int)json_integer_value(curveJ), 0, thm::CURVES_LEN - 1);
+    auto frameModeJ = json_object_get(rootJ, "frameMode");
+    if (frameModeJ)
+      frameMode = clamp((int)json_integer_value(frameModeJ), 0, FRAME_MODES_LEN - 1);
+    auto quantScaleJ = json_object_get(rootJ, "quantScale");
+    if (quantScaleJ)
+      quantScale = clamp((int)json_integer_value(quantScaleJ), 0, thm::SCALES_LEN - 1);
+    auto quantKeyJ = json_object_get(rootJ, "quantKey");
+    if (quantKeyJ)
+      quantKey = clamp((int)json_integer_value(quantKeyJ), 0, 11);
+    auto quantizedJ = json_object_get(rootJ, "quantized");
+    if (quantizedJ)
+      for (int p = 0; p < thm::Image::PLANES; p++)
+        quantized[p] = json_integer_value(quantizedJ) >> p & 1;
+    updateScan();
+    loader.select(selectBox);
   }
 };
         
@@ -202,6 +497,14 @@ struct PictogramDisplay : OpaqueWidget
 {
   Pictogram *module{nullptr};
   int imgHandle {0};
+  unsigned loadedGeneration{0};
+  std::string loadedPath{};
+  std::shared_ptr<const thm::Image> loadedImage{}; // Until its texture exists
+  std::string loadError{};
+  unsigned frameCount{1};
+  unsigned textureFrame{0}; // Frame of an animation the texture shows
+  float imageWidth{};
+  float imageHeight{};
   const int sizex {346};
 //  const int sizex{330};
   const int sizey{330};
@@ -228,15 +531,23 @@ struct PictogramDisplay : OpaqueWidget
     OpaqueWidget::drawLayer(args, layer);
     if (!module)
       return;
+    // Drawing happens relative to the box position of the last frame
+    Vec origin = box.pos;
     // If module is blank full size box would block mouse dragging!
     box.pos = Vec(0,0); 
     box.size = Vec(1,1);
-    if (module->loading || layer != 1 || module->imagePath.empty())
+    if (layer != 1)
       return;
+    bool hasLoadedImage = pollLoader();
+    if (loadedPath.empty())
+    {
+      drawStatus(args, origin);
+      return;
+    }
     float width = sizex;
     float height = sizey;
-    float imagew = module->image_width;
-    float imageh = module->image_height;
+    float imagew = imageWidth;
+    float imageh = imageHeight;
     float ratio = imagew / imageh;
     if (ratio > 1)
       height /= ratio;
@@ -255,10 +566,16 @@ struct PictogramDisplay : OpaqueWidget
     // Make sure image is created only once after it was loaded
     // with module->loadSample(...). DrawLayer runs in a loop
     // at FPS-speed e.g. 60 frames per second!
-    if (module->hasLoadedImage)
+    if (hasLoadedImage)
     {
       // Should not run outside this "if" statement. It's too slow for that!
-      imgHandle = nvgCreateImage(args.vg, module->imagePath.c_str(), 0);
+      if (imgHandle)
+        nvgDeleteImage(args.vg, imgHandle);
+      // Same pixels the module outputs, no second decode by nanovg
+      const thm::Image::Preview &preview = loadedImage->preview;
+      imgHandle = nvgCreateImageRGBA(args.vg, preview.width, preview.height,
+                                     NVG_IMAGE_GENERATE_MIPMAPS, preview.rgba.data());
+      loadedImage.reset();
       if (!module->existJsonData)
       {
         boxView.setSize(30, 30);
@@ -267,8 +584,9 @@ struct PictogramDisplay : OpaqueWidget
       }else
         boxView.setBox(module->slctView);
       SetRgbDataSelectBox(imagew, zoomx, zoomy);
-      module->hasLoadedImage = false;
     }
+    else
+      pollFrame(args.vg);
     NVGpaint imgPaint = nvgImagePattern(args.vg, 0, 0, izx, izy,
                                         0, imgHandle, 1.0f);
     nvgRect(args.vg, 0, 0, izx, izy);
@@ -277,6 +595,7 @@ struct PictogramDisplay : OpaqueWidget
     boxView.draw(args);
     nvgClosePath(args.vg);
     nvgRestore(args.vg);
+    drawStatus(args, origin);
     // Adjusting the select box in module after moving or resizing
     if (boxView.changed)
     {
@@ -285,13 +604,86 @@ struct PictogramDisplay : OpaqueWidget
       boxView.changed = false;
     }
   }
+  // Returns true once for every image the loader has finished
+  bool pollLoader()
+  {
+    unsigned generation = module->loader.getGeneration();
+    if (generation == loadedGeneration)
+      return false;
+    loadedGeneration = generation;
+    thm::ImageLoader::Result result = module->loader.getResult();
+    if (!result.ok)
+    { // The engine keeps the image it had before
+      loadError = result.error;
+      module->imagePath = loadedPath;
+      return false;
+    }
+    loadError.clear();
+    loadedPath = result.path;
+    loadedImage = result.image;
+    imageWidth = result.width;
+    imageHeight = result.height;
+    frameCount = result.frames;
+    textureFrame = 0;
+    return true;
+  }
+  // Animations: the texture follows the frame the engine shows, as
+  // soon as the loader has it decoded
+  void pollFrame(NVGcontext *vg)
+  {
+    unsigned frame = module->displayFrame;
+    if (frameCount <= 1 || frame == textureFrame || !imgHandle)
+      return;
+    std::shared_ptr<const thm::Image> image = module->loader.getFrame(frame);
+    if (!image)
+      return;
+    textureFrame = frame;
+    nvgDeleteImage(vg, imgHandle);
+    const thm::Image::Preview &preview = image->preview;
+    imgHandle = nvgCreateImageRGBA(vg, preview.width, preview.height,
+                                   NVG_IMAGE_GENERATE_MIPMAPS, preview.rgba.data());
+  }
+  // Progress bar while decoding, error text if that failed
+  void drawStatus(const DrawArgs &args, Vec origin)
+  {
+    bool loading = module->loader.isLoading();
+    if (!loading && loadError.empty())
+      return;
+    float cx = parent->box.size.x / 2 - origin.x;
+    float cy = parent->box.size.y / 2 - origin.y;
+    nvgSave(args.vg);
+    if (loading)
+    {
+      float barw = 200.f;
+      nvgBeginPath(args.vg);
+      nvgRect(args.vg, cx - barw / 2, cy - 3, barw, 6);
+      nvgFillColor(args.vg, nvgRGBA(22, 34, 22, 255));
+      nvgFill(args.vg);
+      nvgBeginPath(args.vg);
+      nvgRect(args.vg, cx - barw / 2, cy - 3, barw * module->loader.getProgress(), 6);
+      nvgFillColor(args.vg, nvgRGBA(200, 200, 200, 255));
+      nvgFill(args.vg);
+    }
+    else
+    {
+      std::shared_ptr<window::Font> font = APP->window->loadFont(asset::system("res/fonts/DejaVuSans.ttf"));
+      if (font && font->handle >= 0)
+      {
+        nvgFontFaceId(args.vg, font->handle);
+        nvgFontSize(args.vg, 12);
+        nvgFillColor(args.vg, nvgRGBA(230, 60, 60, 255));
+        nvgTextAlign(args.vg, NVG_ALIGN_CENTER | NVG_ALIGN_MIDDLE);
+        nvgText(args.vg, cx, cy, loadError.c_str(), nullptr);
+      }
+    }
+    nvgRestore(args.vg);
+  }
   void SetRgbDataSelectBox(float imagewidth, float zx, float zy)
   {
-    thm::Rect &rt = module->rgbData.selectBox;
-    rt = boxView.getBox();
+    thm::Rect rt = boxView.getBox();
     rt.imagewidth = imagewidth;
     rt.zoom(zx, zy);
-    module->rgbData.resetPosition();
+    module->setSelectBox(rt);
   }
 };
 
@@ -314,9 +706,15 @@ struct PictogramWidget : ModuleWidget
 
     addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(143.84, 13.584)), module, Pictogram::SCALE_PARAM));
     addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(143.84, 28.06)), module, Pictogram::OFFSET_PARAM));
+    addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(9.0, 13.584)), module, Pictogram::RATE_PARAM));
 
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 28.06)), module, Pictogram::FRAME_INPUT));
     addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 42.536)), module, Pictogram::RESET_INPUT));
     addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 57.012)), module, Pictogram::CLOCK_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 71.488)), module, Pictogram::X_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 85.964)), module, Pictogram::Y_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 100.44)), module, Pictogram::VOCT_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(9.0, 114.916)), module, Pictogram::WAVE_INPUT));
 
     addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(143.84, 42.536)), module, Pictogram::RED_OUTPUT));
     addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(143.84, 57.012)), module, Pictogram::GREEN_OUTPUT));
@@ -350,6 +748,93 @@ struct PictogramWidget : ModuleWidget
     MenuItemLoadpng *ItemLoadpng = createMenuItem<MenuItemLoadpng>("Load image(PNG)");
     ItemLoadpng->module = this->myModule;
     menu->addChild(ItemLoadpng);
+
+    std::vector<std::string> channelLabels;
+    for (int c = 1; c <= PORT_MAX_CHANNELS; c++)
+      channelLabels.push_back(string::f("%d", c));
+    Pictogram *module = this->myModule;
+    menu->addChild(createMenuItem("Load image sequence (folder)", "", [=]() {
+      std::string dir = module->imagePath.empty() ? asset::user("") : rack::system::getDirectory(module->imagePath);
+      char *path = osdialog_file(OSDIALOG_OPEN_DIR, dir.c_str(), nullptr, nullptr);
+      if (path)
+      {
+        module->loadSample(path);
+        std::free(path);
+      }
+    }));
+    menu->addChild(createIndexSubmenuItem("Frame input", {"Next frame at trigger", "Frame position, 0V to 10V"},
+      [=]() { return module->frameMode; },
+      [=](int mode) { module->frameMode = mode; }));
+    menu->addChild(createIndexSubmenuItem("Polyphony channels", channelLabels,
+      [=]() { return module->channels - 1; },
+      [=](int index) { module->channels = index + 1; module->updateScan(); }));
+    menu->addChild(createIndexSubmenuItem("Polyphony reads", {"Consecutive pixels", "Parallel rows"},
+      [=]() { return module->polyMode; },
+      [=](int mode) { module->polyMode = mode; module->updateScan(); }));
+    menu->addChild(createIndexSubmenuItem("Scan order",
+      {"Rows", "Snake", "Columns", "Spiral", "Hilbert curve", "Diagonals", "Random"},
+      [=]() { return module->scanOrder; },
+      [=](int order) { module->scanOrder = order; module->updateScan(); }));
+    menu->addChild(createMenuItem("New random order", "",
+      [=]() { module->scanSeed = random::u32(); module->updateScan(); },
+      module->scanOrder != thm::SCAN_RANDOM));
+    menu->addChild(createIndexSubmenuItem("X/Y interpolation", {"Nearest", "Bilinear", "Bicubic"},
+      [=]() { return module->interpolation; },
+      [=](int mode) { module->interpolation = mode; }));
+    menu->addChild(createIndexSubmenuItem("Output curve", {"Linear", "Exponential", "Semitones"},
+      [=]() { return module->curve; },
+      [=](int shape) { module->curve = shape; }));
+    menu->addChild(createSubmenuItem("Quantizer", "", [=](Menu *menu) {
+      static const char *names[thm::Image::PLANES] = {"Red", "Green", "Blue", "Hue", "Saturation", "Luminance"};
+      for (int p = 0; p < thm::Image::PLANES; p++)
+        menu->addChild(createBoolMenuItem(names[p], "",
+          [=]() { return module->quantized[p]; },
+          [=](bool on) { module->quantized[p] = on; }));
+      menu->addChild(new MenuSeparator);
+      menu->addChild(createIndexSubmenuItem("Scale",
+        {"Chromatic", "Major", "Minor", "Harmonic minor", "Dorian", "Major pentatonic", "Minor pentatonic", "Whole tone"},
+        [=]() { return module->quantScale; },
+        [=](int scale) { module->quantScale = scale; }));
+      menu->addChild(createIndexSubmenuItem("Key", {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"},
+        [=]() { return module->quantKey; },
+        [=](int key) { module->quantKey = key; }));
+    }));
+    menu->addChild(createIndexSubmenuItem("Average", {"Off", "3x3", "5x5", "9x9", "17x17", "33x33", "Whole select box"},
+      [=]() { return module->averaging; },
+      [=](int index) {
+        // Only switching averaging on or off needs the tables rebuilt
+        bool rebuild = (index > 0) != (module->averaging > 0);
+        module->averaging = index;
+        if (rebuild)
+          module->updateScan();
+      }));
+    menu->addChild(createIndexSubmenuItem("Wavetable oscillator", {"Off", "Rows of the select box", "Columns of the select box"},
+      [=]() { return module->waveSource; },
+      [=](int source) {
+        module->waveSource = source;
+        if (source != thm::WAVES_OFF)
+          module->spectrogram = false;
+        module->updateScan();
+      }));
+    menu->addChild(createBoolMenuItem("Spectrogram resynthesis", "",
+      [=]() { return module->spectrogram; },
+      [=](bool on) {
+        module->spectrogram = on;
+        if (on && module->waveSource != thm::WAVES_OFF)
+        {
+          module->waveSource = thm::WAVES_OFF;
+          module->updateScan();
+        }
+      }));
+
+    // Plugin wide, shared by all Pictogram modules
+    static const std::vector<size_t> budgets = {256, 512, 1024, 2048, 4096, 8192};
+    menu->addChild(createIndexSubmenuItem("Image cache size", {"256 MB", "512 MB", "1 GB", "2 GB", "4 GB", "8 GB"},
+      [=]() {
+        size_t mb = thm::ImageCache::instance().getBudget() >> 20;
+        return std::lower_bound(budgets.begin(), budgets.end(), mb) - budgets.begin();
+      },
+      [=](int index) { thm::ImageCache::instance().setBudget(budgets[index] << 20); }));
   }
 };
 
@@ -28,6 +28,17 @@ The manual and changelog are in the header file "lodepng.h"
 Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for C.
 */
 
+/*
+Altered for the Thom's VCV Rack plugin (Pictogram module):
+-inflate reads bits through a 64-bit buffer and decodes huffman symbols with
+ lookup tables instead of walking the tree bit by bit
+-SIMD (SSE2/SSSE3/SSE4.1/AVX2, NEON) unfilter kernels for 3 and 4 bytes per pixel
+-lodepng_decode_into decodes into a buffer owned by the caller, non interlaced
+ images are inflated and unfiltered row by row without a buffer for all scanlines
+-lodepng_decode_rows and lodepng_decode_row_range hand out rows one by one and
+ resume inflating at checkpoints, to decode parts of big images again
+*/
+
 #include "lodepng.h"
 
 #include <limits.h>
@@ -438,23 +449,82 @@ static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, uns
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader for the inflator. Instead of reading one bit at a time from the
+stream, up to 8 bytes are loaded into a 64-bit buffer at once, from which
+huffman symbols and extra bits are then peeked and consumed. Reading past the
+end of the data gives zero bits, the bit pointer is checked against bitsize
+by the callers to detect that.
+*/
+typedef struct LodePNGBitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of data in bits, end of valid bp values, should be 8*size*/
+  size_t bp; /*bit pointer, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
+  unsigned long long buffer; /*holds at least 57 valid bits after ensureBits57*/
+} LodePNGBitReader;
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void LodePNGBitReader_init(LodePNGBitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  ++(*bitpointer);
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->bp = 0;
+  reader->buffer = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*
+Fill the buffer so that at least 57 bits starting at bp can be peeked. That is
+enough for a length/distance pair: 15 + 5 bits length and 15 + 13 bits distance.
+*/
+static void ensureBits57(LodePNGBitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i != nbits; ++i)
+  size_t start = reader->bp >> 3u;
+  const unsigned char* d = reader->data + start;
+  unsigned long long buffer = 0;
+  if(start + 8u <= reader->size)
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    ++(*bitpointer);
+    /*compilers turn this into a single unaligned little endian load*/
+    buffer = (unsigned long long)d[0] | ((unsigned long long)d[1] << 8u) |
+             ((unsigned long long)d[2] << 16u) | ((unsigned long long)d[3] << 24u) |
+             ((unsigned long long)d[4] << 32u) | ((unsigned long long)d[5] << 40u) |
+             ((unsigned long long)d[6] << 48u) | ((unsigned long long)d[7] << 56u);
   }
+  else
+  {
+    size_t i;
+    for(i = 0; start + i < reader->size; ++i) buffer |= (unsigned long long)d[i] << (8u * i);
+  }
+  reader->buffer = buffer >> (reader->bp & 7u);
+}
+
+/*get bits without advancing the bit pointer. Must have enough bits available with ensureBits57. nbits <= 32*/
+static unsigned peekBits(const LodePNGBitReader* reader, size_t nbits)
+{
+  return (unsigned)(reader->buffer & ((1ull << nbits) - 1ull));
+}
+
+/*must have enough bits available with ensureBits57*/
+static void advanceBits(LodePNGBitReader* reader, size_t nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bp += nbits;
+}
+
+/*must have enough bits available with ensureBits57*/
+static unsigned readBits(LodePNGBitReader* reader, size_t nbits)
+{
+  unsigned result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
+  return result;
+}
+
+/*reverse the order of the lowest num bits, huffman codes are stored MSB first*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i < num; i++) result |= ((bits >> (num - i - 1u)) & 1u) << i;
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -504,11 +574,13 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
-  unsigned* tree1d;
+  unsigned* tree1d; /*the huffman codes (bit patterns representing the symbols)*/
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*for decoding only, see HuffmanTree_makeTable*/
+  unsigned char* table_len; /*length of symbol from lookup table, or max length if secondary lookup needed*/
+  unsigned short* table_value; /*value of symbol from lookup table, or index of secondary table if needed*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -526,78 +598,157 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+#ifdef LODEPNG_COMPILE_DECODER
+/*the amount of bits looked up at once in the first level of the decoding table*/
+#define FIRSTBITS 9u
+
+/*a symbol value too big to be valid, returned for bit combinations that no code uses*/
+#define INVALIDSYMBOL 65535u
+
+/*
+The table used by the decoder. return value is error.
+The first level has 2^FIRSTBITS entries, indexed by the next FIRSTBITS bits of
+the stream. Codes of at most FIRSTBITS bits are found there directly, with their
+entry repeated for all values of the unused bits. Codes that are longer share a
+first level entry with all codes that have the same first FIRSTBITS bits. That
+entry holds the longest length of those codes and the index of a secondary table
+that is looked up with the remaining bits.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, pointer, size; /*size is the total table size*/
+  unsigned long long kraft = 0;
+  unsigned* maxlens;
+
+  /*oversubscribed, see comment in lodepng_error_text. Incomplete codes are allowed.*/
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    if(tree->lengths[i] > 15) return 55;
+    if(tree->lengths[i]) kraft += 1ull << (15u - tree->lengths[i]);
+  }
+  if(kraft > (1ull << 15u)) return 55;
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffman tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*compute maxlens: max total bit length of symbols sharing prefix in the first table*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned symbol = tree->tree1d[i];
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue; /*symbols that fit in the first table don't need a secondary table*/
+    /*get the FIRSTBITS MSBs, the MSBs of the symbol are encoded first*/
+    index = reverseBits(symbol >> (l - FIRSTBITS), FIRSTBITS);
+    maxlens[index] = LODEPNG_MAX(maxlens[index], l);
+  }
+  /*compute total table size: size of first table plus all secondary tables*/
+  size = headsize;
+  for(i = 0; i < headsize; ++i)
+  {
+    unsigned l = maxlens[i];
+    if(l > FIRSTBITS) size += (((size_t)1) << (l - FIRSTBITS));
   }
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail, the tables are freed by HuffmanTree_cleanup*/
+  }
+  /*initialize with an invalid length to indicate unused entries*/
+  for(i = 0; i < size; ++i) tree->table_len[i] = 16;
 
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
+  /*fill in the first table for long symbols: max prefix size and index of the secondary tables*/
+  pointer = headsize;
+  for(i = 0; i < headsize; ++i)
   {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (((size_t)1) << (l - FIRSTBITS));
+  }
+  lodepng_free(maxlens);
+
+  /*fill in the first table for short symbols, or secondary table for long symbols*/
+  for(i = 0; i < tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j;
+    if(l == 0) continue;
+    /*reverse bits, because the huffman bits are given in MSB first order but the bit reader reads LSB first*/
+    reverse = reverseBits(tree->tree1d[i], l);
+
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      /*short symbol, fully in first table, replicated num times if l < FIRSTBITS*/
+      unsigned num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; ++j)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        /*bit reader will read the l bits of symbol first, the remaining FIRSTBITS - l bits go to the MSB's*/
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != 16) return 55; /*invalid tree: long symbol shares prefix with short symbol*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      /*long symbol, shares prefix with other long symbols in first lookup table, needs second lookup*/
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      /*log2 of secondary table length, should be >= l - FIRSTBITS*/
+      unsigned tablelen = maxlen - FIRSTBITS;
+      unsigned start = tree->table_value[index]; /*starting index in secondary table*/
+      unsigned num; /*amount of entries of this symbol in secondary table*/
+      if(maxlen < l) return 55; /*invalid tree: long symbol shares prefix with short symbol*/
+      num = 1u << (tablelen - (l - FIRSTBITS));
+      for(j = 0; j < num; ++j)
+      {
+        unsigned reverse2 = reverse >> FIRSTBITS; /*l - FIRSTBITS bits*/
+        unsigned index2 = start + (reverse2 | (j << (l - FIRSTBITS)));
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*
+  Incomplete codes (e.g. a distance tree with 0 or 1 symbols) leave entries
+  unused. Fill them with an invalid symbol so that reading such bits gives an
+  error. As length, use a value that keeps advanceBits valid: at most FIRSTBITS
+  in the first table, more than FIRSTBITS in the secondary tables.
+  */
+  for(i = 0; i < size; ++i)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    if(tree->table_len[i] == 16)
+    {
+      tree->table_len[i] = (i < headsize) ? 1 : (FIRSTBITS + 1);
+      tree->table_value[i] = INVALIDSYMBOL;
+    }
   }
 
   return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
@@ -640,8 +791,10 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+#ifdef LODEPNG_COMPILE_DECODER
+  if(!error) error = HuffmanTree_makeTable(tree);
+#endif /*LODEPNG_COMPILE_DECODER*/
+  return error;
 }
 
 /*
@@ -937,26 +1090,25 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code. The bit reader must have enough bits available with
+ensureBits57. Bit combinations that no code uses give INVALIDSYMBOL.
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned code = peekBits(reader, FIRSTBITS);
+  unsigned l = codetree->table_len[code];
+  unsigned value = codetree->table_value[code];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    advanceBits(reader, l);
+    return value;
+  }
+  else
+  {
+    advanceBits(reader, FIRSTBITS);
+    value += peekBits(reader, l - FIRSTBITS);
+    advanceBits(reader, codetree->table_len[value] - FIRSTBITS);
+    return codetree->table_value[value];
   }
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -977,12 +1129,11 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
 static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+                                      LodePNGBitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -991,29 +1142,31 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + 14 > reader->bitsize) return 49; /*error: the bit pointer is or will go past the memory*/
+  ensureBits57(reader);
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
-  if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + HCLEN * 3 > reader->bitsize) return 50; /*error: the bit pointer is or will go past the memory*/
 
   HuffmanTree_init(&tree_cl);
 
   while(!error)
   {
-    /*read the code length codes out of 3 * (amount of code length codes) bits*/
+    /*read the code length codes out of 3 * (amount of code length codes) bits, at most 57 bits*/
 
     bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
     if(!bitlen_cl) ERROR_BREAK(83 /*alloc fail*/);
 
+    ensureBits57(reader);
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
@@ -1031,7 +1184,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      ensureBits57(reader); /*up to 7 bits for the code and 7 extra bits*/
+      code = huffmanDecodeSymbol(reader, &tree_cl);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1045,8 +1201,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
         if(i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        if((*bp + 2) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 2);
+        if((reader->bp + 2) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += readBits(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1062,8 +1218,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if((*bp + 3) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 3);
+        if((reader->bp + 3) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += readBits(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1078,8 +1234,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if((*bp + 7) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 7);
+        if((reader->bp + 7) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += readBits(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1091,15 +1247,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           ++i;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
-        else error = 16; /*unexisting code, this can never happen*/
+        error = 11; /*error: a bit combination that no code of the tree uses*/
         break;
       }
     }
@@ -1123,25 +1273,90 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len);
+
+/*
+Lets the inflater hand over its output in pieces instead of keeping all of it. Once the
+buffer holds limit bytes, consume gets the bytes it has not taken yet and reports in *used
+how many it took from their front. Only the last 32K (the deflate window) and the bytes
+not taken yet stay in the buffer, the adler32 of the dropped bytes is kept in adler.
+consume may set mark to have the state saved with checkpoint, and done to stop inflating.
+Inflating resumes at a saved state if blockbit and bit are set and the buffer starts
+with the saved window.
+*/
+typedef struct InflateStream
+{
+  unsigned (*consume)(void* context, const unsigned char* data, size_t size, size_t* used);
+  /*window holds the 32K history and the pending bytes not consumed yet at its end*/
+  unsigned (*checkpoint)(void* context, const unsigned char* window, size_t windowsize, size_t pending,
+                         size_t blockbit, size_t bit);
+  void* context;
+  size_t limit;
+  size_t consumed; /*bytes at the start of the buffer that were already taken*/
+  unsigned adler;
+  size_t blockbit; /*bit position of the header of the current block*/
+  size_t bit; /*where to resume inside the block at blockbit, ignored if not past blockbit*/
+  int mark;
+  int done;
+} InflateStream;
+
+/*reader is 0 after the last block, no checkpoint is saved then*/
+static unsigned inflateFlush(ucvector* out, size_t* pos, const LodePNGBitReader* reader, InflateStream* stream)
+{
+  size_t used, drop;
+  do
+  {
+    used = 0;
+    stream->mark = 0;
+    CERROR_TRY_RETURN(stream->consume(stream->context, out->data + stream->consumed, *pos - stream->consumed, &used));
+    stream->consumed += used;
+    if(stream->mark && reader)
+    {
+      size_t begin = *pos > 32768 ? *pos - 32768 : 0;
+      if(begin > stream->consumed) begin = stream->consumed;
+      CERROR_TRY_RETURN(stream->checkpoint(stream->context, out->data + begin, *pos - begin,
+                                           *pos - stream->consumed, stream->blockbit, reader->bp));
+    }
+  }
+  while(stream->mark && !stream->done);
+  /*keep the window, back references may reach 32768 bytes back*/
+  drop = *pos > 32768 ? *pos - 32768 : 0;
+  if(drop > stream->consumed) drop = stream->consumed;
+  if(drop)
+  {
+    stream->adler = update_adler32(stream->adler, out->data, (unsigned)drop);
+    memmove(out->data, out->data + drop, *pos - drop);
+    *pos -= drop;
+    stream->consumed -= drop;
+    out->size = *pos;
+  }
+  return 0;
+}
+
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
+                                    size_t* pos, unsigned btype, size_t resume, InflateStream* stream)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
   if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+  /*the trees are read again from the block header, then go on where a checkpoint was saved*/
+  if(resume) reader->bp = resume;
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
+    unsigned code_ll;
+    /*one refill is enough for a literal, or a length and distance pair with their extra bits*/
+    ensureBits57(reader);
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+    if(reader->bp > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
     if(code_ll <= 255) /*literal symbol*/
     {
       /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
@@ -1160,19 +1375,13 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += readBits(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(reader, &tree_d);
       if(code_d > 29)
       {
-        if(code_d == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: a bit combination that no code of the tree uses*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
@@ -1180,8 +1389,8 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += readBits(reader, numextrabits_d);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = (*pos);
@@ -1203,13 +1412,16 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
+      error = 11; /*error: a bit combination that no code of the tree uses*/
       break;
     }
+    if(stream && *pos >= stream->limit)
+    {
+      error = inflateFlush(out, pos, reader, stream);
+      if(stream->done) break;
+    }
   }
 
   HuffmanTree_cleanup(&tree_ll);
@@ -1218,14 +1430,15 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader, size_t* pos)
 {
+  const unsigned char* in = reader->data;
+  size_t inlength = reader->size;
   size_t p;
-  unsigned LEN, NLEN, n, error = 0;
+  unsigned LEN, NLEN, error = 0;
 
   /*go to first boundary of byte*/
-  while(((*bp) & 0x7) != 0) ++(*bp);
-  p = (*bp) / 8; /*byte position*/
+  p = (reader->bp + 7u) >> 3u; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
   if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
@@ -1239,38 +1452,59 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
+  memcpy(out->data + *pos, in + p, LEN);
+  *pos += LEN;
+  p += LEN;
 
-  (*bp) = p * 8;
+  reader->bp = p * 8;
 
   return error;
 }
 
+/*stream may be NULL, then all output stays in out*/
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+                                 const LodePNGDecompressSettings* settings, InflateStream* stream)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  LodePNGBitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
+  size_t resume = 0;
   unsigned error = 0;
 
   (void)settings;
 
+  LodePNGBitReader_init(&reader, in, insize);
+  if(stream)
+  {
+    /*a resumed stream starts with the saved window in out*/
+    pos = out->size;
+    reader.bp = stream->blockbit;
+    if(stream->bit > stream->blockbit) resume = stream->bit;
+  }
+
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    if(reader.bp + 2 >= reader.bitsize) return 52; /*error, bit pointer will jump past memory*/
+    if(stream) stream->blockbit = reader.bp;
+    ensureBits57(&reader);
+    BFINAL = readBits(&reader, 1);
+    BTYPE = readBits(&reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE, resume, stream); /*compression, BTYPE 01 or 10*/
+    resume = 0;
 
+    if(!error && stream && !stream->done && pos >= stream->limit)
+    {
+      /*between blocks, a checkpoint starts at the next block header*/
+      stream->blockbit = reader.bp;
+      error = inflateFlush(out, &pos, BFINAL ? 0 : &reader, stream);
+    }
     if(error) return error;
+    if(stream && stream->done) break;
   }
 
   return error;
@@ -1283,7 +1517,7 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_inflatev(&v, in, insize, settings);
+  error = lodepng_inflatev(&v, in, insize, settings, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -2119,10 +2353,8 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+static unsigned zlib_check_header(const unsigned char* in, size_t insize)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
@@ -2150,6 +2382,14 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
       "The additional flags shall not specify a preset dictionary."*/
     return 26;
   }
+  return 0;
+}
+
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
 
   error = inflate(out, outsize, in + 2, insize - 2, settings);
   if(error) return error;
@@ -2177,6 +2417,37 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
   }
 }
 
+/*like lodepng_zlib_decompress, but hands the output to stream->consume piece by piece,
+all of it is consumed when this returns without error. Ignores custom_zlib and custom_inflate.*/
+static unsigned zlib_decompress_stream(const unsigned char* in, size_t insize,
+                                       const LodePNGDecompressSettings* settings, InflateStream* stream)
+{
+  ucvector out;
+  size_t pos;
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
+
+  ucvector_init(&out);
+  stream->consumed = 0;
+  stream->adler = 1;
+  stream->blockbit = 0;
+  stream->bit = 0;
+  stream->done = 0;
+  error = lodepng_inflatev(&out, in + 2, insize - 2, settings, stream);
+  pos = out.size;
+  if(!error && !stream->done) error = inflateFlush(&out, &pos, 0, stream);
+  /*a rest shorter than a scanline is never taken by consume, it is still too much data*/
+  if(!error && !stream->done && pos != stream->consumed) error = 91;
+  if(!error && !settings->ignore_adler32)
+  {
+    unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
+    unsigned checksum = update_adler32(stream->adler, out.data, (unsigned)pos);
+    if(checksum != ADLER32) error = 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+  ucvector_cleanup(&out);
+  return error;
+}
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -4182,18 +4453,423 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length)
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+SIMD versions of unfilterScanline for the common case of 3 and 4 bytes per
+pixel (RGB8 and RGBA8). Sub, Avg and Paeth depend on the pixel to the left, so
+they handle one pixel per step with all its channels in one vector, except Sub
+with 4 bytes per pixel which uses an in-register prefix sum. Up has no such
+dependency and handles 16 or 32 bytes per step.
+SSE2 (and SSSE3/SSE4.1 when the compiler targets them) or NEON are chosen at
+compile time, AVX2 is compiled with a target attribute and chosen at runtime.
+All kernels give exactly the same result as the scalar code. They load a block
+before they store it, which keeps them correct when recon overlaps scanline.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LODEPNG_SIMD_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LODEPNG_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+#ifdef LODEPNG_SIMD_SSE2
+/*loads and stores of a single pixel, memcpy keeps them inside the scanline*/
+static __m128i sse2_load4(const unsigned char* p)
 {
-  /*
-  For PNG filter method 0
-  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
-  the filter works byte per byte (bytewidth = 1)
-  precon is the previous unfiltered scanline, recon the result, scanline the current one
-  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
-  recon and scanline MAY be the same memory address! precon must be disjoint.
-  */
+  int v;
+  memcpy(&v, p, 4);
+  return _mm_cvtsi32_si128(v);
+}
+
+static __m128i sse2_load3(const unsigned char* p)
+{
+  int v = 0;
+  memcpy(&v, p, 3);
+  return _mm_cvtsi32_si128(v);
+}
+
+static void sse2_store4(unsigned char* p, __m128i v)
+{
+  int t = _mm_cvtsi128_si32(v);
+  memcpy(p, &t, 4);
+}
+
+static void sse2_store3(unsigned char* p, __m128i v)
+{
+  int t = _mm_cvtsi128_si32(v);
+  memcpy(p, &t, 3);
+}
+
+static __m128i sse2_abs16(__m128i x)
+{
+#if defined(__SSSE3__)
+  return _mm_abs_epi16(x);
+#else
+  /*x < 0 ? -x : x, negating is flipping all bits and adding 1*/
+  __m128i negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+  return _mm_sub_epi16(_mm_xor_si128(x, negative), negative);
+#endif
+}
+
+/*bytewise c ? t : e*/
+static __m128i sse2_select(__m128i c, __m128i t, __m128i e)
+{
+#if defined(__SSE4_1__)
+  return _mm_blendv_epi8(e, t, c);
+#else
+  return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+#endif
+}
+
+/*
+One Paeth step on 16-bit lanes. a is the reconstructed pixel to the left, b the
+one above and c the one above left, d the filtered pixel. Ties favor a over b over c,
+as in paethPredictor.
+*/
+static __m128i sse2_paeth(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+  __m128i pa = _mm_sub_epi16(b, c); /*p - a = b - c*/
+  __m128i pb = _mm_sub_epi16(a, c); /*p - b = a - c*/
+  __m128i pc = _mm_add_epi16(pa, pb); /*p - c = (b - c) + (a - c)*/
+  __m128i smallest, nearest;
+  pa = sse2_abs16(pa);
+  pb = sse2_abs16(pb);
+  pc = sse2_abs16(pc);
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  nearest = sse2_select(_mm_cmpeq_epi16(smallest, pa), a,
+            sse2_select(_mm_cmpeq_epi16(smallest, pb), b, c));
+  /*bytewise add: wraps the low byte modulo 256 and keeps the high byte 0*/
+  return _mm_add_epi8(d, nearest);
+}
+
+/*the truncating average of a and b added to d. _mm_avg_epu8 rounds up, which is undone for odd sums*/
+static __m128i sse2_avg(__m128i a, __m128i b, __m128i d)
+{
+  __m128i avg = _mm_avg_epu8(a, b);
+  avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+  return _mm_add_epi8(d, avg);
+}
+
+static void unfilterSub_sse2(unsigned char* recon, const unsigned char* scanline, size_t length, size_t bytewidth)
+{
+  /*the first pixel has no left neighbour, starting with a = 0 handles it like the others*/
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  if(bytewidth == 4)
+  {
+    for(; i + 16 <= length; i += 16)
+    {
+      /*prefix sum of the 4 pixels, plus the last pixel of the previous block*/
+      __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, a);
+      _mm_storeu_si128((__m128i*)(recon + i), x);
+      a = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    for(; i < length; i += 4)
+    {
+      a = _mm_add_epi8(a, sse2_load4(scanline + i));
+      sse2_store4(recon + i, a);
+    }
+  }
+  else
+  {
+    for(; i < length; i += 3)
+    {
+      a = _mm_add_epi8(a, sse2_load3(scanline + i));
+      sse2_store3(recon + i, a);
+    }
+  }
+}
+
+static void unfilterUp_sse2(unsigned char* recon, const unsigned char* scanline,
+                            const unsigned char* precon, size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+    _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+  }
+  for(; i < length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAvg_sse2(unsigned char* recon, const unsigned char* scanline,
+                             const unsigned char* precon, size_t length, size_t bytewidth)
+{
+  /*the first pixel is predicted as half of the pixel above, which is what a = 0 gives*/
+  __m128i a = _mm_setzero_si128();
+  size_t i;
+  if(bytewidth == 4)
+  {
+    for(i = 0; i < length; i += 4)
+    {
+      a = sse2_avg(a, sse2_load4(precon + i), sse2_load4(scanline + i));
+      sse2_store4(recon + i, a);
+    }
+  }
+  else
+  {
+    for(i = 0; i < length; i += 3)
+    {
+      a = sse2_avg(a, sse2_load3(precon + i), sse2_load3(scanline + i));
+      sse2_store3(recon + i, a);
+    }
+  }
+}
+
+static void unfilterPaeth_sse2(unsigned char* recon, const unsigned char* scanline,
+                               const unsigned char* precon, size_t length, size_t bytewidth)
+{
+  /*the first pixel uses p = b, which is what a = c = 0 gives*/
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, b = zero, c;
+  size_t i;
+  if(bytewidth == 4)
+  {
+    for(i = 0; i < length; i += 4)
+    {
+      c = b;
+      b = _mm_unpacklo_epi8(sse2_load4(precon + i), zero);
+      a = sse2_paeth(a, b, c, _mm_unpacklo_epi8(sse2_load4(scanline + i), zero));
+      sse2_store4(recon + i, _mm_packus_epi16(a, a));
+    }
+  }
+  else
+  {
+    for(i = 0; i < length; i += 3)
+    {
+      c = b;
+      b = _mm_unpacklo_epi8(sse2_load3(precon + i), zero);
+      a = sse2_paeth(a, b, c, _mm_unpacklo_epi8(sse2_load3(scanline + i), zero));
+      sse2_store3(recon + i, _mm_packus_epi16(a, a));
+    }
+  }
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
+#ifdef LODEPNG_SIMD_AVX2
+__attribute__((target("avx2")))
+static void unfilterUp_avx2(unsigned char* recon, const unsigned char* scanline,
+                            const unsigned char* precon, size_t length)
+{
+  size_t i = 0;
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(precon + i));
+    _mm256_storeu_si256((__m256i*)(recon + i), _mm256_add_epi8(x, b));
+  }
+  for(; i < length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static int lodepng_cpu_has_avx2(void)
+{
+  return __builtin_cpu_supports("avx2");
+}
+#endif /*LODEPNG_SIMD_AVX2*/
+
+#ifdef LODEPNG_SIMD_NEON
+static uint8x8_t neon_load4(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static uint8x8_t neon_load3(const unsigned char* p)
+{
+  uint32_t v = 0;
+  memcpy(&v, p, 3);
+  return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static void neon_store4(unsigned char* p, uint8x8_t v)
+{
+  uint32_t t = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+  memcpy(p, &t, 4);
+}
+
+static void neon_store3(unsigned char* p, uint8x8_t v)
+{
+  uint32_t t = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+  memcpy(p, &t, 3);
+}
+
+/*see sse2_paeth, a, b and c are the reconstructed neighbours, d the filtered pixel*/
+static uint8x8_t neon_paeth(uint8x8_t a, uint8x8_t b, uint8x8_t c, uint8x8_t d)
+{
+  int16x8_t a16 = vreinterpretq_s16_u16(vmovl_u8(a));
+  int16x8_t b16 = vreinterpretq_s16_u16(vmovl_u8(b));
+  int16x8_t c16 = vreinterpretq_s16_u16(vmovl_u8(c));
+  int16x8_t pa = vabdq_s16(b16, c16);
+  int16x8_t pb = vabdq_s16(a16, c16);
+  int16x8_t pc = vabdq_s16(vaddq_s16(a16, b16), vaddq_s16(c16, c16));
+  uint16x8_t use_a = vandq_u16(vcleq_s16(pa, pb), vcleq_s16(pa, pc));
+  uint16x8_t use_b = vcleq_s16(pb, pc);
+  uint8x8_t nearest = vmovn_u16(vbslq_u16(use_a, vmovl_u8(a), vbslq_u16(use_b, vmovl_u8(b), vmovl_u8(c))));
+  return vadd_u8(d, nearest);
+}
+
+static void unfilterSub_neon(unsigned char* recon, const unsigned char* scanline, size_t length, size_t bytewidth)
+{
+  uint8x8_t a = vdup_n_u8(0);
+  size_t i;
+  if(bytewidth == 4)
+  {
+    for(i = 0; i < length; i += 4)
+    {
+      a = vadd_u8(a, neon_load4(scanline + i));
+      neon_store4(recon + i, a);
+    }
+  }
+  else
+  {
+    for(i = 0; i < length; i += 3)
+    {
+      a = vadd_u8(a, neon_load3(scanline + i));
+      neon_store3(recon + i, a);
+    }
+  }
+}
+
+static void unfilterUp_neon(unsigned char* recon, const unsigned char* scanline,
+                            const unsigned char* precon, size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    uint8x16_t x = vld1q_u8(scanline + i);
+    vst1q_u8(recon + i, vaddq_u8(x, vld1q_u8(precon + i)));
+  }
+  for(; i < length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAvg_neon(unsigned char* recon, const unsigned char* scanline,
+                             const unsigned char* precon, size_t length, size_t bytewidth)
+{
+  /*vhadd_u8 is the truncating average (a + b) >> 1 that PNG asks for*/
+  uint8x8_t a = vdup_n_u8(0);
+  size_t i;
+  if(bytewidth == 4)
+  {
+    for(i = 0; i < length; i += 4)
+    {
+      a = vadd_u8(neon_load4(scanline + i), vhadd_u8(a, neon_load4(precon + i)));
+      neon_store4(recon + i, a);
+    }
+  }
+  else
+  {
+    for(i = 0; i < length; i += 3)
+    {
+      a = vadd_u8(neon_load3(scanline + i), vhadd_u8(a, neon_load3(precon + i)));
+      neon_store3(recon + i, a);
+    }
+  }
+}
+
+static void unfilterPaeth_neon(unsigned char* recon, const unsigned char* scanline,
+                               const unsigned char* precon, size_t length, size_t bytewidth)
+{
+  uint8x8_t a = vdup_n_u8(0), b = vdup_n_u8(0), c;
+  size_t i;
+  if(bytewidth == 4)
+  {
+    for(i = 0; i < length; i += 4)
+    {
+      c = b;
+      b = neon_load4(precon + i);
+      a = neon_paeth(a, b, c, neon_load4(scanline + i));
+      neon_store4(recon + i, a);
+    }
+  }
+  else
+  {
+    for(i = 0; i < length; i += 3)
+    {
+      c = b;
+      b = neon_load3(precon + i);
+      a = neon_paeth(a, b, c, neon_load3(scanline + i));
+      neon_store3(recon + i, a);
+    }
+  }
+}
+#endif /*LODEPNG_SIMD_NEON*/
 
+/*
+Unfilters the scanline with a SIMD kernel if there is one for this case.
+Returns 1 if it did, 0 if the scalar code has to do it.
+*/
+static int unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, unsigned char filterType, size_t length)
+{
+#if defined(LODEPNG_SIMD_SSE2) || defined(LODEPNG_SIMD_NEON)
+  int pixelfilter = (bytewidth == 3 || bytewidth == 4); /*Sub, Avg and Paeth kernels*/
+  if(filterType == 1 && pixelfilter)
+  {
+#ifdef LODEPNG_SIMD_SSE2
+    unfilterSub_sse2(recon, scanline, length, bytewidth);
+#else
+    unfilterSub_neon(recon, scanline, length, bytewidth);
+#endif
+    return 1;
+  }
+  if(!precon) return 0; /*the first scanline is cheap, the scalar code handles it*/
+  if(filterType == 2)
+  {
+#if defined(LODEPNG_SIMD_AVX2)
+    if(lodepng_cpu_has_avx2()) unfilterUp_avx2(recon, scanline, precon, length);
+    else unfilterUp_sse2(recon, scanline, precon, length);
+#elif defined(LODEPNG_SIMD_SSE2)
+    unfilterUp_sse2(recon, scanline, precon, length);
+#else
+    unfilterUp_neon(recon, scanline, precon, length);
+#endif
+    return 1;
+  }
+  if(filterType == 3 && pixelfilter)
+  {
+#ifdef LODEPNG_SIMD_SSE2
+    unfilterAvg_sse2(recon, scanline, precon, length, bytewidth);
+#else
+    unfilterAvg_neon(recon, scanline, precon, length, bytewidth);
+#endif
+    return 1;
+  }
+  if(filterType == 4 && pixelfilter)
+  {
+#ifdef LODEPNG_SIMD_SSE2
+    unfilterPaeth_sse2(recon, scanline, precon, length, bytewidth);
+#else
+    unfilterPaeth_neon(recon, scanline, precon, length, bytewidth);
+#endif
+    return 1;
+  }
+#else /*no SIMD*/
+  (void)recon; (void)scanline; (void)precon; (void)bytewidth; (void)filterType; (void)length;
+#endif
+  return 0;
+}
+
+/*the reference for the SIMD kernels, see tests/unfilter.cpp*/
+static unsigned unfilterScanlineScalar(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                       size_t bytewidth, unsigned char filterType, size_t length)
+{
   size_t i;
   switch(filterType)
   {
@@ -4256,6 +4932,21 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   return 0;
 }
 
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+  /*
+  For PNG filter method 0
+  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
+  the filter works byte per byte (bytewidth = 1)
+  precon is the previous unfiltered scanline, recon the result, scanline the current one
+  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
+  recon and scanline MAY be the same memory address! precon must be disjoint.
+  */
+  if(unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+  return unfilterScanlineScalar(recon, scanline, precon, bytewidth, filterType, length);
+}
+
 static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
 {
   /*
@@ -4822,17 +5513,14 @@ static unsigned readChunk_iCCP(LodePNGInfo* info, const LodePNGDecompressSetting
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*reads the header and all chunks, the IDAT data is gathered in idat, which must be initialized by the caller*/
+static void readChunks(ucvector* idat, unsigned* w, unsigned* h,
+                       LodePNGState* state,
+                       const unsigned char* in, size_t insize)
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
-  size_t predict;
-  size_t outsize = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4840,9 +5528,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
@@ -4851,7 +5536,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     CERROR_RETURN(state->error, 92); /*overflow possible due to amount of pixels*/
   }
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4889,11 +5573,11 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
+      size_t oldsize = idat->size;
       size_t newsize;
       if(lodepng_addofl(oldsize, chunkLength, &newsize)) CERROR_BREAK(state->error, 95);
-      if(!ucvector_resize(&idat, newsize)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
+      if(!ucvector_resize(idat, newsize)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+      for(i = 0; i != chunkLength; ++i) idat->data[oldsize + i] = data[i];
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -5011,35 +5695,69 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
+}
+
+/*inflates the IDAT data into scanlines, checking that the size matches the image*/
+static void inflateScanlines(ucvector* scanlines, const ucvector* idat, unsigned w, unsigned h,
+                             LodePNGState* state)
+{
+  size_t predict;
 
-  ucvector_init(&scanlines);
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
   If the decompressed size does not match the prediction, the image must be corrupt.*/
   if(state->info_png.interlace_method == 0)
   {
-    predict = lodepng_get_raw_size_idat(*w, *h, &state->info_png.color);
+    predict = lodepng_get_raw_size_idat(w, h, &state->info_png.color);
   }
   else
   {
     /*Adam-7 interlaced: predicted size is the sum of the 7 sub-images sizes*/
     const LodePNGColorMode* color = &state->info_png.color;
     predict = 0;
-    predict += lodepng_get_raw_size_idat((*w + 7) >> 3, (*h + 7) >> 3, color);
-    if(*w > 4) predict += lodepng_get_raw_size_idat((*w + 3) >> 3, (*h + 7) >> 3, color);
-    predict += lodepng_get_raw_size_idat((*w + 3) >> 2, (*h + 3) >> 3, color);
-    if(*w > 2) predict += lodepng_get_raw_size_idat((*w + 1) >> 2, (*h + 3) >> 2, color);
-    predict += lodepng_get_raw_size_idat((*w + 1) >> 1, (*h + 1) >> 2, color);
-    if(*w > 1) predict += lodepng_get_raw_size_idat((*w + 0) >> 1, (*h + 1) >> 1, color);
-    predict += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, color);
-  }
-  if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
+    predict += lodepng_get_raw_size_idat((w + 7) >> 3, (h + 7) >> 3, color);
+    if(w > 4) predict += lodepng_get_raw_size_idat((w + 3) >> 3, (h + 7) >> 3, color);
+    predict += lodepng_get_raw_size_idat((w + 3) >> 2, (h + 3) >> 3, color);
+    if(w > 2) predict += lodepng_get_raw_size_idat((w + 1) >> 2, (h + 3) >> 2, color);
+    predict += lodepng_get_raw_size_idat((w + 1) >> 1, (h + 1) >> 2, color);
+    if(w > 1) predict += lodepng_get_raw_size_idat((w + 0) >> 1, (h + 1) >> 1, color);
+    predict += lodepng_get_raw_size_idat((w + 0), (h + 0) >> 1, color);
+  }
+  if(!state->error && !ucvector_reserve(scanlines, predict)) state->error = 83; /*alloc fail*/
   if(!state->error)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
-    if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
+    state->error = zlib_decompress(&scanlines->data, &scanlines->size, idat->data,
+                                   idat->size, &state->decoder.zlibsettings);
+    if(!state->error && scanlines->size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
   }
+}
+
+/*reads all chunks and inflates the IDAT data into scanlines, which must be initialized by the caller.
+The scanlines are left filtered (and interlaced if the image is), see postProcessScanlines*/
+static void decodeScanlines(ucvector* scanlines, unsigned* w, unsigned* h,
+                            LodePNGState* state,
+                            const unsigned char* in, size_t insize)
+{
+  ucvector idat; /*the data from idat chunks*/
+
+  ucvector_init(&idat);
+  readChunks(&idat, w, h, state, in, insize);
+  if(!state->error) inflateScanlines(scanlines, &idat, *w, *h, state);
   ucvector_cleanup(&idat);
+}
+
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize)
+{
+  ucvector scanlines;
+  size_t i;
+  size_t outsize = 0;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  ucvector_init(&scanlines);
+  decodeScanlines(&scanlines, w, h, state, in, insize);
 
   if(!state->error)
   {
@@ -5100,6 +5818,431 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*unfilters the scanlines of a non interlaced image row by row as the inflater produces them,
+straight into the output or through row buffers, lodepng_convert and an optional callback*/
+typedef struct ScanlineSink
+{
+  unsigned char* out; /*the whole image, or 0 to hand each row to callback*/
+  const LodePNGColorMode* mode_out;
+  const LodePNGColorMode* mode_in;
+  unsigned w, h, y;
+  size_t bytewidth, linebytes, outlinebytes;
+  int convert;
+  unsigned char* prevline; /*row buffers, only used if convert or without out*/
+  unsigned char* line;
+  unsigned char* outline; /*converted row for callback*/
+  unsigned y0, y1; /*rows given to callback, inflating stops after y1*/
+  LodePNGRowCallback callback;
+  void* context;
+  LodePNGRowIndex* index; /*gets a checkpoint every index->interval rows, or 0*/
+  unsigned marked; /*row of the last checkpoint asked for*/
+  InflateStream* stream;
+} ScanlineSink;
+
+static unsigned consumeScanlines(void* context, const unsigned char* data, size_t size, size_t* used)
+{
+  ScanlineSink* sink = (ScanlineSink*)context;
+  int buffered = sink->convert || !sink->out;
+  *used = 0;
+  while(size - *used >= sink->linebytes + 1)
+  {
+    const unsigned char* scanline = data + *used;
+    unsigned char* recon;
+    const unsigned char* precon;
+    if(sink->y == sink->h) return 91; /*more data than the image has pixels*/
+    if(sink->y >= sink->y1)
+    {
+      sink->stream->done = 1;
+      return 0;
+    }
+    if(sink->index && sink->y != 0 && sink->y % sink->index->interval == 0 && sink->y != sink->marked)
+    {
+      /*stop at the row boundary so the checkpoint starts exactly at row y*/
+      sink->marked = sink->y;
+      sink->stream->mark = 1;
+      return 0;
+    }
+    recon = buffered ? sink->line : &sink->out[sink->linebytes * sink->y];
+    precon = sink->y == 0 ? 0 : (buffered ? sink->prevline : recon - sink->linebytes);
+    CERROR_TRY_RETURN(unfilterScanline(recon, scanline + 1, precon, sink->bytewidth, scanline[0], sink->linebytes));
+    if(buffered)
+    {
+      unsigned char* swap = sink->prevline;
+      if(sink->out)
+      {
+        CERROR_TRY_RETURN(lodepng_convert(&sink->out[sink->outlinebytes * sink->y], sink->line,
+                                          sink->mode_out, sink->mode_in, sink->w, 1));
+      }
+      else if(sink->y >= sink->y0)
+      {
+        const unsigned char* row = sink->line;
+        if(sink->convert)
+        {
+          CERROR_TRY_RETURN(lodepng_convert(sink->outline, sink->line, sink->mode_out, sink->mode_in, sink->w, 1));
+          row = sink->outline;
+        }
+        CERROR_TRY_RETURN(sink->callback(sink->context, sink->y, row));
+      }
+      sink->prevline = sink->line;
+      sink->line = swap;
+    }
+    ++sink->y;
+    *used += sink->linebytes + 1;
+  }
+  if(sink->y >= sink->y1 && sink->y1 < sink->h) sink->stream->done = 1;
+  return 0;
+}
+
+static unsigned saveCheckpoint(void* context, const unsigned char* window, size_t windowsize, size_t pending,
+                               size_t blockbit, size_t bit)
+{
+  ScanlineSink* sink = (ScanlineSink*)context;
+  LodePNGRowIndex* index = sink->index;
+  LodePNGRowCheckpoint* checkpoint;
+  void* grown = lodepng_realloc(index->checkpoints, (index->count + 1) * sizeof(LodePNGRowCheckpoint));
+  if(!grown) return 83; /*alloc fail*/
+  index->checkpoints = (LodePNGRowCheckpoint*)grown;
+  checkpoint = &index->checkpoints[index->count];
+  checkpoint->y = sink->y;
+  checkpoint->blockbit = blockbit;
+  checkpoint->bit = bit;
+  checkpoint->windowsize = windowsize;
+  checkpoint->pending = pending;
+  checkpoint->window = (unsigned char*)lodepng_malloc(windowsize);
+  checkpoint->prevline = (unsigned char*)lodepng_malloc(sink->linebytes);
+  if(!checkpoint->window || !checkpoint->prevline)
+  {
+    lodepng_free(checkpoint->window);
+    lodepng_free(checkpoint->prevline);
+    return 83; /*alloc fail*/
+  }
+  memcpy(checkpoint->window, window, windowsize);
+  memcpy(checkpoint->prevline, sink->prevline, sink->linebytes);
+  ++index->count;
+  return 0;
+}
+
+/*sets up a sink for the rows [y0, y1) of a non interlaced image, without out the rows go
+to callback. The row buffers are allocated here, free them with cleanupScanlineSink*/
+static unsigned initScanlineSink(ScanlineSink* sink, InflateStream* stream, unsigned char* out,
+                                 unsigned w, unsigned h, unsigned y0, unsigned y1, const LodePNGState* state)
+{
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  sink->out = out;
+  sink->mode_out = &state->info_raw;
+  sink->mode_in = &state->info_png.color;
+  sink->w = w;
+  sink->h = h;
+  sink->y = 0;
+  sink->bytewidth = (bpp + 7) / 8;
+  sink->linebytes = ((size_t)w * bpp + 7) / 8;
+  sink->outlinebytes = ((size_t)w * lodepng_get_bpp(&state->info_raw) + 7) / 8;
+  sink->convert = !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color);
+  sink->prevline = 0;
+  sink->line = 0;
+  sink->outline = 0;
+  sink->y0 = y0;
+  sink->y1 = y1;
+  sink->callback = 0;
+  sink->context = 0;
+  sink->index = 0;
+  sink->marked = 0;
+  sink->stream = stream;
+  if(bpp == 0) return 31; /*error: invalid colortype*/
+  if(sink->convert || !out)
+  {
+    sink->prevline = (unsigned char*)lodepng_malloc(sink->linebytes);
+    sink->line = (unsigned char*)lodepng_malloc(sink->linebytes);
+    if(!sink->prevline || !sink->line) return 83; /*alloc fail*/
+  }
+  if(sink->convert && !out)
+  {
+    sink->outline = (unsigned char*)lodepng_malloc(sink->outlinebytes);
+    if(!sink->outline) return 83; /*alloc fail*/
+    /*sub-byte rows are or-ed into place by lodepng_convert*/
+    memset(sink->outline, 0, sink->outlinebytes);
+  }
+
+  stream->consume = consumeScanlines;
+  stream->checkpoint = saveCheckpoint;
+  stream->context = sink;
+  /*the window plus a batch of rows, so the buffer is rarely moved*/
+  stream->limit = 32768 + 131072 + 2 * (sink->linebytes + 1);
+  stream->consumed = 0;
+  stream->blockbit = 0;
+  stream->bit = 0;
+  stream->mark = 0;
+  stream->done = 0;
+  return 0;
+}
+
+static void cleanupScanlineSink(ScanlineSink* sink)
+{
+  lodepng_free(sink->prevline);
+  lodepng_free(sink->line);
+  lodepng_free(sink->outline);
+}
+
+/*decodes the IDAT data of a non interlaced image into out without holding all scanlines,
+the rows of out (in the info_raw color type) must start at whole bytes*/
+static unsigned decodeStreaming(unsigned char* out, unsigned w, unsigned h,
+                                LodePNGState* state, const ucvector* idat)
+{
+  ScanlineSink sink;
+  InflateStream stream;
+  unsigned error = initScanlineSink(&sink, &stream, out, w, h, 0, h, state);
+  if(!error) error = zlib_decompress_stream(idat->data, idat->size, &state->decoder.zlibsettings, &stream);
+  if(!error && sink.y != h) error = 91; /*decompressed size doesn't match the image*/
+  cleanupScanlineSink(&sink);
+  return error;
+}
+
+void lodepng_row_index_init(LodePNGRowIndex* index)
+{
+  index->interval = 0;
+  index->w = index->h = 0;
+  index->checkpoints = 0;
+  index->count = 0;
+}
+
+void lodepng_row_index_cleanup(LodePNGRowIndex* index)
+{
+  size_t i;
+  for(i = 0; i != index->count; ++i)
+  {
+    lodepng_free(index->checkpoints[i].window);
+    lodepng_free(index->checkpoints[i].prevline);
+  }
+  lodepng_free(index->checkpoints);
+  index->checkpoints = 0;
+  index->count = 0;
+}
+
+/*copies the bytes [begin, end) of the IDAT data, as if all IDAT chunks were joined, into out.
+The chunks were checked by readChunks before.*/
+static unsigned readIdatRange(ucvector* out, const unsigned char* in, size_t insize, size_t begin, size_t end)
+{
+  const unsigned char* chunk = &in[33];
+  size_t offset = 0; /*of the chunk in the joined IDAT data*/
+  if(!ucvector_resize(out, 0) || !ucvector_reserve(out, end - begin < insize ? end - begin : insize))
+  {
+    return 83; /*alloc fail*/
+  }
+  while(offset < end)
+  {
+    unsigned chunkLength;
+    if((size_t)((chunk - in) + 12) > insize || chunk < in) return 30;
+    chunkLength = lodepng_chunk_length(chunk);
+    if((size_t)((chunk - in) + chunkLength + 12) > insize || (chunk + chunkLength + 12) < in) return 64;
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+    if(lodepng_chunk_type_equals(chunk, "IDAT"))
+    {
+      size_t first = begin > offset ? begin - offset : 0;
+      size_t last = end - offset < chunkLength ? end - offset : chunkLength;
+      if(first < last)
+      {
+        size_t oldsize = out->size;
+        if(!ucvector_resize(out, oldsize + (last - first))) return 83; /*alloc fail*/
+        memcpy(out->data + oldsize, lodepng_chunk_data_const(chunk) + first, last - first);
+      }
+      offset += chunkLength;
+    }
+    chunk = lodepng_chunk_next_const(chunk);
+  }
+  return 0;
+}
+
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize, LodePNGRowIndex* index,
+                             LodePNGRowCallback callback, void* context)
+{
+  ucvector idat;
+  ScanlineSink sink;
+  InflateStream stream;
+
+  ucvector_init(&idat);
+  readChunks(&idat, w, h, state, in, insize);
+  if(!state->error && !state->decoder.color_convert)
+  {
+    state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  }
+  if(!state->error && !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)
+     && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+     && !(state->info_raw.bitdepth == 8))
+  {
+    state->error = 56; /*unsupported color mode conversion*/
+  }
+  if(!state->error && state->info_png.interlace_method != 0) state->error = 106;
+  if(state->error)
+  {
+    ucvector_cleanup(&idat);
+    return state->error;
+  }
+
+  state->error = initScanlineSink(&sink, &stream, 0, *w, *h, 0, *h, state);
+  sink.callback = callback;
+  sink.context = context;
+  if(index)
+  {
+    lodepng_row_index_cleanup(index);
+    index->w = *w;
+    index->h = *h;
+    if(index->interval) sink.index = index;
+  }
+  if(!state->error) state->error = zlib_decompress_stream(idat.data, idat.size, &state->decoder.zlibsettings, &stream);
+  if(!state->error && sink.y != *h) state->error = 91; /*decompressed size doesn't match the image*/
+  cleanupScanlineSink(&sink);
+  ucvector_cleanup(&idat);
+  return state->error;
+}
+
+unsigned lodepng_decode_row_range(unsigned y0, unsigned y1, const LodePNGState* state,
+                                  const unsigned char* in, size_t insize, const LodePNGRowIndex* index,
+                                  LodePNGRowCallback callback, void* context)
+{
+  ucvector deflated;
+  ucvector out;
+  ScanlineSink sink;
+  InflateStream stream;
+  const LodePNGRowCheckpoint* start = 0;
+  size_t begin, end = (size_t)(-1), margin, i;
+  unsigned error;
+
+  if(y1 > index->h) y1 = index->h;
+  if(y0 >= y1) return 0;
+  error = initScanlineSink(&sink, &stream, 0, index->w, index->h, y0, y1, state);
+  sink.callback = callback;
+  sink.context = context;
+  /*resume at the last checkpoint above the rows. Inflating stops at a flush after row y1, which
+  may be a batch of rows and a stored block later, the data has to reach that far*/
+  margin = stream.limit + 65536;
+  for(i = 0; i != index->count; ++i)
+  {
+    const LodePNGRowCheckpoint* checkpoint = &index->checkpoints[i];
+    if(checkpoint->y <= y0) start = checkpoint;
+    else if(checkpoint->y >= y1 && (size_t)(checkpoint->y - y1) * (sink.linebytes + 1) >= margin)
+    {
+      end = 2 + (checkpoint->bit + 7) / 8;
+      break;
+    }
+  }
+  /*the bits of the deflate data follow the 2 byte zlib header*/
+  begin = 2 + (start ? start->blockbit / 8 : 0);
+
+  ucvector_init(&deflated);
+  ucvector_init(&out);
+  /*without a checkpoint that far, up to the end of the IDAT data*/
+  if(!error) error = readIdatRange(&deflated, in, insize, begin, end);
+  if(!error && start)
+  {
+    if(!ucvector_resize(&out, start->windowsize)) error = 83; /*alloc fail*/
+    else
+    {
+      memcpy(out.data, start->window, start->windowsize);
+      memcpy(sink.prevline, start->prevline, sink.linebytes);
+      sink.y = start->y;
+      stream.consumed = start->windowsize - start->pending;
+      stream.blockbit = start->blockbit - (begin - 2) * 8;
+      stream.bit = start->bit - (begin - 2) * 8;
+    }
+  }
+  if(!error) error = lodepng_inflatev(&out, deflated.data, deflated.size, &state->decoder.zlibsettings, &stream);
+  if(!error && !stream.done)
+  {
+    size_t pos = out.size;
+    error = inflateFlush(&out, &pos, 0, &stream);
+    if(!error && !stream.done && pos != stream.consumed) error = 91; /*more data than the image has pixels*/
+  }
+  if(!error && sink.y < y1) error = 91; /*decompressed size doesn't match the image*/
+  cleanupScanlineSink(&sink);
+  ucvector_cleanup(&out);
+  ucvector_cleanup(&deflated);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize)
+{
+  ucvector idat;
+  ucvector scanlines;
+  unsigned bpp;
+  size_t i;
+  size_t pngsize;
+  int equal = 0;
+
+  ucvector_init(&idat);
+  ucvector_init(&scanlines);
+  readChunks(&idat, w, h, state, in, insize);
+  if(!state->error && !state->decoder.color_convert)
+  {
+    state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  }
+  if(!state->error && outsize < lodepng_get_raw_size(*w, *h, &state->info_raw)) state->error = 105;
+  if(!state->error)
+  {
+    equal = lodepng_color_mode_equal(&state->info_raw, &state->info_png.color);
+    if(!equal && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+       && !(state->info_raw.bitdepth == 8))
+    {
+      state->error = 56; /*unsupported color mode conversion*/
+    }
+  }
+#ifdef LODEPNG_COMPILE_ZLIB
+  /*the common case: inflate and unfilter row by row, no buffer holds all scanlines*/
+  if(!state->error && state->info_png.interlace_method == 0
+     && !state->decoder.zlibsettings.custom_zlib && !state->decoder.zlibsettings.custom_inflate
+     && ((size_t)*w * lodepng_get_bpp(&state->info_raw)) % 8 == 0)
+  {
+    state->error = decodeStreaming(out, *w, *h, state, &idat);
+    ucvector_cleanup(&idat);
+    return state->error;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(!state->error) inflateScanlines(&scanlines, &idat, *w, *h, state);
+  ucvector_cleanup(&idat);
+  if(state->error)
+  {
+    ucvector_cleanup(&scanlines);
+    return state->error;
+  }
+
+  bpp = lodepng_get_bpp(&state->info_png.color);
+  if(equal)
+  {
+    /*same color type, unfilter straight into the caller's buffer*/
+    if(bpp < 8) for(i = 0; i < outsize; i++) out[i] = 0;
+    state->error = postProcessScanlines(out, scanlines.data, *w, *h, &state->info_png);
+  }
+  else if(state->info_png.interlace_method == 0 && bpp >= 8)
+  {
+    /*unfilter in place, the rows end up packed at the start of the scanlines, then convert from there*/
+    state->error = unfilter(scanlines.data, scanlines.data, *w, *h, bpp);
+    if(!state->error) state->error = lodepng_convert(out, scanlines.data, &state->info_raw,
+                                                     &state->info_png.color, *w, *h);
+  }
+  else
+  {
+    /*interlaced or sub-byte pixels need a buffer in the PNG color type first*/
+    unsigned char* data;
+    pngsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+    data = (unsigned char*)lodepng_malloc(pngsize);
+    if(!data) state->error = 83; /*alloc fail*/
+    if(!state->error)
+    {
+      for(i = 0; i < pngsize; i++) data[i] = 0;
+      state->error = postProcessScanlines(data, scanlines.data, *w, *h, &state->info_png);
+    }
+    if(!state->error) state->error = lodepng_convert(out, data, &state->info_raw,
+                                                     &state->info_png.color, *w, *h);
+    lodepng_free(data);
+  }
+  ucvector_cleanup(&scanlines);
+  return state->error;
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -6510,6 +7653,8 @@ const char* lodepng_error_text(unsigned code)
     case 102: return "not allowed to set greyscale ICC profile with colored pixels by PNG specification";
     case 103: return "Invalid palette index in bKGD chunk. Maybe it came before PLTE chunk?";
     case 104: return "Invalid bKGD color while encoding (e.g. palette index out of range)";
+    case 105: return "output buffer given to lodepng_decode_into is too small";
+    case 106: return "only non interlaced images can be decoded row by row";
   }
   return "unknown error code";
 }
@@ -64,6 +64,11 @@ the custom_zlib field of the compress and decompress settings*/
 #ifndef LODEPNG_NO_COMPILE_ANCILLARY_CHUNKS
 #define LODEPNG_COMPILE_ANCILLARY_CHUNKS
 #endif
+/*SIMD versions of the PNG unfilter step for RGB8 and RGBA8 (SSE2/SSSE3/AVX2 or NEON,
+with scalar fallback). Kernels that the target does not support are left out.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
 /*ability to convert error numerical codes to English text string*/
 #ifndef LODEPNG_NO_COMPILE_ERROR_TEXT
 #define LODEPNG_COMPILE_ERROR_TEXT
@@ -760,6 +765,71 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+Same as lodepng_decode, but writes the pixels into a buffer owned by the caller
+instead of allocating one, so the image is never held twice. out must hold at
+least lodepng_get_raw_size(w, h, &state->info_raw) bytes, call lodepng_inspect
+first to learn w and h. Returns error 105 if outsize is too small.
+Non interlaced images are inflated and unfiltered row by row, then besides out
+only the compressed data, the 32K deflate window and a few rows are held (not
+with a custom_zlib or custom_inflate).
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+State to resume decoding at row y, saved by lodepng_decode_rows. The bit positions count
+from the start of the deflate data, after the 2 byte zlib header.
+*/
+typedef struct LodePNGRowCheckpoint
+{
+  unsigned y; /*first row after the checkpoint*/
+  size_t blockbit; /*header of the deflate block the inflater was in*/
+  size_t bit; /*next deflate symbol, equal to blockbit between blocks*/
+  unsigned char* window; /*last inflated bytes: the 32K history, then the pending bytes*/
+  size_t windowsize;
+  size_t pending; /*bytes of row y and on that were inflated already*/
+  unsigned char* prevline; /*row y - 1 unfiltered, in the PNG color type*/
+} LodePNGRowCheckpoint;
+
+/*checkpoints every interval rows of one image*/
+typedef struct LodePNGRowIndex
+{
+  unsigned interval; /*set before lodepng_decode_rows, 0 to save none*/
+  unsigned w, h;
+  LodePNGRowCheckpoint* checkpoints;
+  size_t count;
+} LodePNGRowIndex;
+
+void lodepng_row_index_init(LodePNGRowIndex* index);
+void lodepng_row_index_cleanup(LodePNGRowIndex* index);
+
+/*gets each row in the info_raw color type, a nonzero return value stops decoding with that error*/
+typedef unsigned (*LodePNGRowCallback)(void* context, unsigned y, const unsigned char* row);
+
+/*
+Decodes a non interlaced image row by row and hands the rows to callback, so the image
+is never held whole. If index is given it gets a checkpoint every index->interval rows,
+for lodepng_decode_row_range later on. Interlaced images give error 106. The compressed
+data is held while decoding, custom_zlib and custom_inflate are not used.
+*/
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize, LodePNGRowIndex* index,
+                             LodePNGRowCallback callback, void* context);
+
+/*
+Decodes the rows [y0, y1) again, starting at the last checkpoint of index above y0. Only
+the compressed data from there on until a checkpoint well below y1 is read. state must be
+the one lodepng_decode_rows used, in the same file with the same index. Does not change
+state, so several threads may decode ranges of one image at once with their own copy.
+*/
+unsigned lodepng_decode_row_range(unsigned y0, unsigned y1, const LodePNGState* state,
+                                  const unsigned char* in, size_t insize, const LodePNGRowIndex* index,
+                                  LodePNGRowCallback callback, void* context);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the IHDR chunk of the PNG, such as width, height and color type. The
@@ -0,0 +1,409 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "pictogramtools.hpp"
+#include "mappedfile.hpp"
+#include "dep/lodepng/lodepng.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <memory>
+
+namespace thm
+{
+  /*
+    The frames of an animated PNG (APNG) or of a folder of numbered
+    PNG files. Frames are decoded one at a time on request, so a long
+    animation is never held as a whole, the loader keeps a window of
+    them. APNG frames build on each other: they are composited onto a
+    canvas in order, as the dispose and blend ops of their fcTL chunks
+    say. A frame behind the canvas starts over from the nearest frame
+    that covers the whole canvas. Not thread safe, loader thread only.
+  */
+  struct FrameSequence
+  {
+    // Errors of our own, next to the lodepng error codes
+    enum { ERROR_BAD_FRAME = 1000, ERROR_NO_FRAMES, ERROR_TOO_BIG };
+    // Frames are always decoded as a whole, so their size is limited
+    enum { LARGEST_FRAME = 1 << 24 };
+
+    static const char *errorText(unsigned error)
+    {
+      switch (error)
+      {
+      case ERROR_BAD_FRAME:
+        return "invalid APNG frame";
+      case ERROR_NO_FRAMES:
+        return "no PNG files in the folder";
+      case ERROR_TOO_BIG:
+        return "animation frames of more than 16 megapixels";
+      default:
+        return lodepng_error_text(error);
+      }
+    }
+    /*
+      Opens path, a folder or an APNG. Returns 0 or an error code. A
+      PNG that is not animated gives no sequence, it is a still image,
+      and so is the only PNG of a folder. still is the file to load then.
+    */
+    static unsigned open(const std::string &path, std::unique_ptr<FrameSequence> &sequence, std::string &still)
+    {
+      sequence.reset();
+      still = path;
+      std::unique_ptr<FrameSequence> s(new FrameSequence());
+      unsigned error = rack::system::isDirectory(path) ? s->openFolder(path) : s->openAnimation(path);
+      if (error == 0 && s->count() > 1)
+        sequence = std::move(s);
+      else if (error == 0 && s->isFolder())
+        still = s->files[0];
+      return error;
+    }
+    unsigned getWidth() const
+    {
+      return width;
+    }
+    unsigned getHeight() const
+    {
+      return height;
+    }
+    unsigned count() const
+    {
+      return files.empty() ? frames.size() : files.size();
+    }
+    bool isFolder() const
+    {
+      return !files.empty();
+    }
+    // Seconds the APNG shows frame for, 0 for the frames of a folder
+    float getDelay(unsigned frame) const
+    {
+      return isFolder() ? 0.f : frames[frame].delay;
+    }
+    /*
+      Fill the pixels of image with frame, image is width x height.
+      Returns 0 or an error code.
+    */
+    unsigned decode(unsigned frame, Image &image)
+    {
+      try
+      {
+        image.pixels.resize(size_t(width) * height);
+      }
+      catch (const std::exception &) // bad_alloc
+      {
+        return 83;
+      }
+      image.width = width;
+      image.height = height;
+      image.region = Image::Region{0, 0, width, height};
+      return isFolder() ? decodeFile(frame, image) : decodeFrame(frame, image);
+    }
+
+  private:
+    enum { DISPOSE_NONE, DISPOSE_BACKGROUND, DISPOSE_PREVIOUS };
+    enum { BLEND_SOURCE, BLEND_OVER };
+    // One fcTL chunk and the image data that follows it
+    struct Frame
+    {
+      unsigned x, y, width, height;
+      float delay;
+      int dispose, blend;
+      std::vector<unsigned char> data{}; // Copied, the file is not kept open
+    };
+    unsigned width{}, height{};
+    // APNG
+    std::vector<unsigned char> header{}; // IHDR and the chunks that go with every frame
+    std::vector<Frame> frames{};
+    std::vector<unsigned char> canvas{};   // RGBA, ready for frame next
+    std::vector<unsigned char> previous{}; // Canvas before a DISPOSE_PREVIOUS frame
+    unsigned next{0};
+    // Folder
+    std::vector<std::string> files{};
+
+    static unsigned read32(const unsigned char *p)
+    {
+      return unsigned(p[0]) << 24 | unsigned(p[1]) << 16 | unsigned(p[2]) << 8 | p[3];
+    }
+    static void write32(std::vector<unsigned char> &out, unsigned value)
+    {
+      for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(value >> shift & 0xff);
+    }
+    static void appendChunk(std::vector<unsigned char> &out, const char *type, const std::vector<unsigned char> &data)
+    {
+      write32(out, data.size());
+      size_t start = out.size();
+      out.insert(out.end(), type, type + 4);
+      out.insert(out.end(), data.begin(), data.end());
+      write32(out, lodepng_crc32(out.data() + start, data.size() + 4));
+    }
+
+    // Only mapped while the chunks are read, a file changed on disk
+    // later on cannot fault the decoding
+    unsigned openAnimation(const std::string &path)
+    {
+      MappedFile file{};
+      unsigned error = file.open(path);
+      const unsigned char *data = file.data();
+      size_t size = file.size();
+      LodePNGState state;
+      lodepng_state_init(&state);
+      if (error == 0)
+        error = lodepng_inspect(&width, &height, &state, data, size);
+      lodepng_state_cleanup(&state);
+      if (error != 0)
+        return error;
+      bool animated = false;
+      bool seenData = false;
+      const unsigned char *end = data + size;
+      for (const unsigned char *chunk = data + 8; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk))
+      {
+        unsigned length = lodepng_chunk_length(chunk);
+        if (length > size_t(end - chunk) - 12)
+          return 63; // Chunk length too large
+        const unsigned char *body = lodepng_chunk_data_const(chunk);
+        if (lodepng_chunk_type_equals(chunk, "IEND"))
+          break;
+        if (lodepng_chunk_type_equals(chunk, "acTL"))
+          animated = true;
+        else if (lodepng_chunk_type_equals(chunk, "fcTL"))
+        {
+          if (length < 26)
+            return ERROR_BAD_FRAME;
+          Frame frame;
+          frame.x = read32(body + 12);
+          frame.y = read32(body + 16);
+          frame.width = read32(body + 4);
+          frame.height = read32(body + 8);
+          frame.dispose = body[24];
+          frame.blend = body[25];
+          unsigned num = body[20] << 8 | body[21];
+          unsigned den = body[22] << 8 | body[23];
+          frame.delay = float(num) / (den ? den : 100);
+          // As browsers do, very short frames last a tenth of a second
+          if (frame.delay <= 0.01f)
+            frame.delay = 0.1f;
+          if (frame.width == 0 || frame.height == 0 || frame.x >= width || frame.y >= height ||
+              frame.width > width - frame.x || frame.height > height - frame.y ||
+              frame.dispose > DISPOSE_PREVIOUS || frame.blend > BLEND_OVER)
+            return ERROR_BAD_FRAME;
+          frames.push_back(frame);
+        }
+        else if (lodepng_chunk_type_equals(chunk, "IDAT"))
+        {
+          // Without an fcTL before it the default image is not part of the animation
+          seenData = true;
+          if (!frames.empty())
+            frames.back().data.insert(frames.back().data.end(), body, body + length);
+        }
+        else if (lodepng_chunk_type_equals(chunk, "fdAT"))
+        {
+          if (length < 4 || frames.empty())
+            return ERROR_BAD_FRAME;
+          frames.back().data.insert(frames.back().data.end(), body + 4, body + length);
+        }
+        else if (!seenData && (lodepng_chunk_type_equals(chunk, "IHDR") || lodepng_chunk_type_equals(chunk, "PLTE") ||
+                               lodepng_chunk_type_equals(chunk, "tRNS")))
+          header.insert(header.end(), chunk, chunk + length + 12);
+      }
+      if (!animated)
+      {
+        frames.clear();
+        return 0;
+      }
+      if (size_t(width) * height > LARGEST_FRAME)
+        return ERROR_TOO_BIG;
+      for (const Frame &frame : frames)
+        if (frame.data.empty())
+          return ERROR_BAD_FRAME;
+      return 0;
+    }
+    unsigned openFolder(const std::string &path)
+    {
+      for (const std::string &entry : rack::system::getEntries(path))
+      {
+        std::string name = rack::system::getFilename(entry);
+        std::string extension = name.size() > 4 ? name.substr(name.size() - 4) : "";
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension == ".png" && rack::system::isFile(entry))
+          files.push_back(entry);
+      }
+      if (files.empty())
+        return ERROR_NO_FRAMES;
+      // By the number at the end of the name, so frame10 comes after frame9
+      auto number = [](const std::string &path) {
+        std::string name = rack::system::getFilename(path);
+        size_t end = name.size() - 4;
+        size_t begin = end;
+        while (begin > 0 && std::isdigit((unsigned char)name[begin - 1]))
+          begin--;
+        return begin < end ? std::stoull(name.substr(begin, std::min<size_t>(end - begin, 18))) : 0ull;
+      };
+      std::stable_sort(files.begin(), files.end(), [&](const std::string &a, const std::string &b) {
+        unsigned long long na = number(a), nb = number(b);
+        return na != nb ? na < nb : a < b;
+      });
+      // The first frame sets the size of all of them
+      MappedFile first{};
+      LodePNGState state;
+      lodepng_state_init(&state);
+      unsigned error = first.open(files[0]);
+      if (error == 0)
+        error = lodepng_inspect(&width, &height, &state, first.data(), first.size());
+      lodepng_state_cleanup(&state);
+      // A single file is a still image, of any size
+      if (error == 0 && files.size() > 1 && size_t(width) * height > LARGEST_FRAME)
+        error = ERROR_TOO_BIG;
+      if (error != 0)
+        files.clear();
+      return error;
+    }
+    // A frame of a folder. Files of another size are cut to the first
+    // one or padded with black.
+    unsigned decodeFile(unsigned frame, Image &image)
+    {
+      std::vector<unsigned char> rgb{};
+      unsigned w = 0, h = 0;
+      MappedFile png{};
+      unsigned error = png.open(files[frame]);
+      if (error == 0)
+        error = lodepng::decode(rgb, w, h, png.data(), png.size(), LCT_RGB, 8);
+      if (error != 0)
+        return error;
+      if (w == width && h == height)
+      {
+        std::memcpy(image.pixels.data(), rgb.data(), rgb.size());
+        return 0;
+      }
+      std::fill(image.pixels.begin(), image.pixels.end(), RGB{0, 0, 0});
+      for (unsigned y = 0; y < std::min(h, height); y++)
+        std::memcpy(&image.pixels[size_t(y) * width], &rgb[size_t(y) * w * 3], std::min(w, width) * 3);
+      return 0;
+    }
+    // Whether frame paints over all of the canvas, so the canvas before does not matter
+    bool isKeyFrame(unsigned frame) const
+    {
+      const Frame &f = frames[frame];
+      // Disposed of to the canvas before it, which a restart would not have
+      if (frame > 0 && f.dispose == DISPOSE_PREVIOUS)
+        return false;
+      return frame == 0 || (f.x == 0 && f.y == 0 && f.width == width && f.height == height && f.blend == BLEND_SOURCE);
+    }
+    unsigned decodeFrame(unsigned frame, Image &image)
+    {
+      try
+      {
+        canvas.resize(size_t(width) * height * 4);
+      }
+      catch (const std::exception &) // bad_alloc
+      {
+        return 83;
+      }
+      unsigned start = frame;
+      while (!isKeyFrame(start))
+        start--;
+      if (frame < next || start > next)
+      {
+        std::fill(canvas.begin(), canvas.end(), 0);
+        next = start;
+      }
+      for (; next <= frame; next++)
+      {
+        unsigned error = composite(next, next == frame ? &image : nullptr);
+        if (error != 0)
+        {
+          next = frames.size(); // Start over next time
+          return error;
+        }
+      }
+      return 0;
+    }
+    // Paint frame onto the canvas, copy the result to image if given
+    // and dispose of the frame
+    unsigned composite(unsigned index, Image *image)
+    {
+      const Frame &frame = frames[index];
+      // A PNG of its own: the header with the frame size and all the data in one IDAT
+      std::vector<unsigned char> png{0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+      png.insert(png.end(), header.begin(), header.end());
+      unsigned char *ihdr = png.data() + 8;
+      for (int i = 0; i < 4; i++)
+      {
+        ihdr[8 + i] = frame.width >> (24 - 8 * i) & 0xff;
+        ihdr[12 + i] = frame.height >> (24 - 8 * i) & 0xff;
+      }
+      lodepng_chunk_generate_crc(ihdr);
+      appendChunk(png, "IDAT", frame.data);
+      appendChunk(png, "IEND", {});
+      std::vector<unsigned char> rgba{};
+      unsigned w, h;
+      unsigned error = lodepng::decode(rgba, w, h, png, LCT_RGBA, 8);
+      if (error != 0)
+        return error;
+      int dispose = frame.dispose == DISPOSE_PREVIOUS && index == 0 ? DISPOSE_BACKGROUND : frame.dispose;
+      if (dispose == DISPOSE_PREVIOUS)
+        previous = canvas;
+      for (unsigned y = 0; y < h; y++)
+      {
+        const unsigned char *src = &rgba[size_t(y) * w * 4];
+        unsigned char *dst = &canvas[((size_t(frame.y) + y) * width + frame.x) * 4];
+        if (frame.blend == BLEND_SOURCE)
+        {
+          std::memcpy(dst, src, size_t(w) * 4);
+          continue;
+        }
+        for (unsigned x = 0; x < w; x++, src += 4, dst += 4)
+        {
+          // Straight alpha over
+          unsigned sa = src[3];
+          if (sa == 255)
+            std::memcpy(dst, src, 4);
+          else if (sa > 0)
+          {
+            unsigned da = dst[3] * (255 - sa) / 255;
+            unsigned a = sa + da;
+            for (int c = 0; c < 3; c++)
+              dst[c] = (src[c] * sa + dst[c] * da) / a;
+            dst[3] = a;
+          }
+        }
+      }
+      if (image)
+      {
+        // Alpha is dropped, as for still images
+        const unsigned char *src = canvas.data();
+        for (RGB &pixel : image->pixels)
+        {
+          pixel = RGB{src[0], src[1], src[2]};
+          src += 4;
+        }
+      }
+      if (dispose == DISPOSE_PREVIOUS)
+        canvas.swap(previous);
+      else if (dispose == DISPOSE_BACKGROUND)
+        for (unsigned y = 0; y < h; y++)
+          std::memset(&canvas[((size_t(frame.y) + y) * width + frame.x) * 4], 0, size_t(w) * 4);
+      return 0;
+    }
+  };
+};
@@ -0,0 +1,171 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "pictogramtools.hpp"
+#include <sys/stat.h>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+
+namespace thm
+{
+  /*
+    Decoded images shared by all Pictogram modules of the plugin.
+    An entry is keyed by path, modification time and file size, so
+    an edited file is decoded again. Images nobody uses anymore are
+    evicted least recently used first once the cache holds more than
+    its budget. The budget is kept in the user folder (Thoms.json).
+  */
+  struct ImageCache
+  {
+    using Decoder = std::function<std::shared_ptr<const Image>()>;
+
+    static ImageCache &instance()
+    {
+      static ImageCache cache;
+      return cache;
+    }
+    /*
+      Returns the cached image of path or calls decode() to make it.
+      If another module is decoding the same file, wait for it instead.
+      Failed decodes are not cached.
+    */
+    std::shared_ptr<const Image> get(const std::string &path, const Decoder &decode)
+    {
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0)
+        return decode(); // Let the decoder report the error
+      Stamp stamp{int64_t(st.st_mtime), int64_t(st.st_size)};
+      std::unique_lock<std::mutex> lock(mutex);
+      trim(); // Images let go of since the last call
+      std::list<Entry>::iterator it;
+      while ((it = find(path, stamp)) != entries.end())
+      {
+        if (it->image)
+        {
+          entries.splice(entries.begin(), entries, it);
+          return it->image;
+        }
+        cv.wait(lock);
+      }
+      entries.push_front(Entry{path, stamp, nullptr});
+      it = entries.begin();
+      lock.unlock();
+      std::shared_ptr<const Image> image = decode();
+      lock.lock();
+      if (image)
+      {
+        it->image = image;
+        used += image->bytes();
+        trim();
+      }
+      else
+        entries.erase(it);
+      cv.notify_all();
+      return image;
+    }
+    size_t getBudget()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return budget;
+    }
+    void setBudget(size_t bytes)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      budget = bytes;
+      trim();
+      json_t *rootJ = json_object();
+      json_object_set_new(rootJ, "imageCacheBudget", json_integer(budget));
+      json_dump_file(rootJ, settingsPath().c_str(), JSON_INDENT(2));
+      json_decref(rootJ);
+    }
+
+  private:
+    struct Stamp
+    {
+      int64_t mtime;
+      int64_t size;
+    };
+    struct Entry
+    {
+      std::string path;
+      Stamp stamp;
+      std::shared_ptr<const Image> image; // Null while it is decoded
+    };
+    std::mutex mutex{};
+    std::condition_variable cv{};
+    std::list<Entry> entries{}; // Most recently used first
+    size_t used{0};
+    size_t budget{size_t(1) << 30};
+
+    ImageCache()
+    {
+      json_error_t error;
+      json_t *rootJ = json_load_file(settingsPath().c_str(), 0, &error);
+      if (!rootJ)
+        return;
+      json_t *budgetJ = json_object_get(rootJ, "imageCacheBudget");
+      if (budgetJ && json_integer_value(budgetJ) > 0)
+        budget = json_integer_value(budgetJ);
+      json_decref(rootJ);
+    }
+    static std::string settingsPath()
+    {
+      return asset::user("Thoms.json");
+    }
+    // Finds the entry of path. Entries of an older version of the file are dropped.
+    std::list<Entry>::iterator find(const std::string &path, const Stamp &stamp)
+    {
+      for (auto it = entries.begin(); it != entries.end();)
+      {
+        if (it->path != path)
+          ++it;
+        else if (it->stamp.mtime == stamp.mtime && it->stamp.size == stamp.size)
+          return it;
+        else if (it->image)
+        {
+          used -= it->image->bytes();
+          it = entries.erase(it);
+        }
+        else
+          ++it;
+      }
+      return entries.end();
+    }
+    // Evict unused images, oldest first, until the budget is met.
+    // Images still held by a module cost memory either way and stay.
+    void trim()
+    {
+      for (auto it = entries.end(); it != entries.begin() && used > budget;)
+      {
+        --it;
+        if (it->image && it->image.use_count() == 1)
+        {
+          used -= it->image->bytes();
+          it = entries.erase(it);
+        }
+      }
+    }
+  };
+};
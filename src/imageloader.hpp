@@ -0,0 +1,551 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "pictogramtools.hpp"
+#include "framesequence.hpp"
+#include "imagecache.hpp"
+#include "mappedfile.hpp"
+#include "regiondecoder.hpp"
+#include "scanpath.hpp"
+#include "dep/lodepng/lodepng.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <climits>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace thm
+{
+  /*
+    Hands immutable objects to the engine thread, RCU style.
+    The reader announces the epoch it has seen before it loads the
+    pointer. A replaced object is freed by the writer as soon as the
+    reader has announced an epoch at least as new as the replacement.
+  */
+  template <typename T>
+  struct Publisher
+  {
+    // Writer side, loader thread only
+    void publish(std::shared_ptr<const T> object)
+    {
+      latest.store(object.get());
+      uint64_t replaced = epoch.fetch_add(1) + 1;
+      if (current)
+        retired.push_back(Retired{current, replaced});
+      current = object;
+    }
+    void reclaim()
+    {
+      uint64_t seen = readerEpoch.load();
+      retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                   [seen](const Retired &r) { return r.epoch <= seen; }),
+                    retired.end());
+    }
+    // Reader side, called by module->process(). Never blocks.
+    const T *acquire()
+    {
+      readerEpoch.store(epoch.load());
+      return latest.load();
+    }
+
+  private:
+    struct Retired
+    {
+      std::shared_ptr<const T> object;
+      uint64_t epoch;
+    };
+    std::atomic<const T *> latest{nullptr};
+    std::atomic<uint64_t> epoch{1};
+    std::atomic<uint64_t> readerEpoch{0};
+    std::shared_ptr<const T> current{};
+    std::vector<Retired> retired{};
+  };
+
+  /*
+    Decodes images on a worker thread and publishes them with a
+    Publisher, so process() never sees a half built vector and the
+    GUI never waits for lodepng. The engine gets the image together
+    with the ScanPath over the select box, rebuilt here whenever the
+    box or the scan order changes. Of images too big to keep decoded
+    only the part under the select box is published, see
+    RegionDecoder. Of animations only a window of frames from the one
+    the engine asks for on is decoded, see FrameSequence and seek().
+  */
+  struct ImageLoader
+  {
+    // Largest display texture. Twice the 346x330 display, so it stays
+    // sharp when the rack is zoomed in.
+    static constexpr int PREVIEW_WIDTH = 2 * 346;
+    static constexpr int PREVIEW_HEIGHT = 2 * 330;
+    // Memory the decoded frames of an animation may take, at least
+    // MIN_WINDOW and at most MAX_WINDOW frames are kept
+    static constexpr size_t WINDOW_BYTES = size_t(256) << 20;
+    enum { MIN_WINDOW = 2, MAX_WINDOW = 16 };
+
+    // Outcome of the last finished request, read by the widget
+    struct Result
+    {
+      bool ok{false};
+      std::string path{};
+      std::string error{};
+      unsigned width{};
+      unsigned height{};
+      unsigned frames{1};
+      std::shared_ptr<const Image> image{}; // For the display texture
+    };
+
+    ImageLoader() : worker(&ImageLoader::run, this) {}
+    ~ImageLoader()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+      cv.notify_one();
+      worker.join();
+    }
+    // Queue a decode. A request that has not started yet is replaced.
+    void load(const std::string &path)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      request = path;
+      pending = true;
+      progress = 0.f;
+      loading = true;
+      cv.notify_one();
+    }
+    // The select box in image pixels. Decides which part of an image
+    // decoded region by region the engine gets.
+    void select(const Rect &area)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      box = area;
+      boxPending = true;
+      layoutEdits++;
+      cv.notify_one();
+    }
+    void setScan(const ScanSettings &settings)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      scan = settings;
+      scanPending = true;
+      layoutEdits++;
+      cv.notify_one();
+    }
+    bool isLoading() const
+    {
+      return loading;
+    }
+    float getProgress() const
+    {
+      return progress;
+    }
+    // Bumped whenever a request has finished, successful or not
+    unsigned getGeneration() const
+    {
+      return generation;
+    }
+    Result getResult()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return result;
+    }
+    // Newest published frames, see Publisher::acquire()
+    const FrameSet *acquire()
+    {
+      return publisher.acquire();
+    }
+    // The frame of an animation the engine shows. The loader decodes
+    // the window of frames from there on. Never blocks.
+    void seek(unsigned frame)
+    {
+      wanted = frame;
+    }
+    // A decoded frame of the animation, for the display. Null if it is
+    // not in the window.
+    std::shared_ptr<const Image> getFrame(unsigned frame)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = resident.find(frame);
+      return it != resident.end() ? it->second : nullptr;
+    }
+
+  private:
+    std::mutex mutex{};
+    std::condition_variable cv{};
+    std::string request{};
+    Result result{};
+    Rect box{};
+    ScanSettings scan{SCAN_ROWS, 0, 1, false, WAVES_OFF};
+    bool pending{false};
+    bool boxPending{false};
+    bool scanPending{false};
+    unsigned layoutEdits{0}; // Counts select() and setScan() calls
+    std::shared_ptr<const Image> source{}; // Last image loaded, worker only
+    std::shared_ptr<const Image> shown{};  // Last image published, worker only
+    bool quit{false};
+    std::atomic<bool> loading{false};
+    std::atomic<float> progress{0.f};
+    std::atomic<unsigned> generation{0};
+    Publisher<FrameSet> publisher{};
+    unsigned layout{0}; // Bumped for every still path and every new box or scan order of an animation
+    // The animation, worker only
+    std::unique_ptr<FrameSequence> sequence{};
+    std::shared_ptr<const std::vector<float>> delays{};
+    std::map<unsigned, std::shared_ptr<const Image>> resident{};      // Decoded frames, changed under the mutex
+    std::map<unsigned, std::shared_ptr<const ScanPath>> framePaths{}; // Their paths over the box
+    unsigned windowFirst{UINT_MAX};
+    unsigned windowSize{MIN_WINDOW};
+    std::atomic<unsigned> wanted{0};
+    WorkerPool::User poolUser{}; // Stops the pool threads with the last module
+    std::thread worker; // Last member, run() uses all of the above
+
+    void run()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!quit)
+      {
+        if (!pending && (boxPending || scanPending))
+        {
+          // Lay out the path under the moved box, for big images over
+          // the part of the image under it
+          bool moved = boxPending;
+          boxPending = scanPending = false;
+          if (sequence)
+          {
+            // The frames stay, their paths are laid out again
+            layout++;
+            framePaths.clear();
+            continue;
+          }
+          std::shared_ptr<const Image> image = source;
+          Rect area = box;
+          ScanSettings settings = scan;
+          if (!image)
+            continue;
+          lock.unlock();
+          if (image->regions)
+            image = moved || !shown ? image->regions->crop(area) : shown;
+          std::shared_ptr<const ScanPath> path = image ? buildScanPath(image, area, settings) : nullptr;
+          lock.lock();
+          if (image && !pending)
+          {
+            shown = image;
+            publishStill(path);
+          }
+          continue;
+        }
+        if (!pending && sequence && stepSequence(lock))
+          continue;
+        if (!pending)
+        {
+          // Wake up now and then to free images the engine let go of,
+          // and often while an animation plays to follow its frames
+          cv.wait_for(lock, std::chrono::milliseconds(sequence ? 5 : 100));
+          publisher.reclaim();
+          continue;
+        }
+        std::string path = request;
+        pending = false;
+        lock.unlock();
+        Result res{};
+        res.path = path;
+        // Animations are decoded frame by frame, each module its own
+        // window of them. Modules loading the same still image share
+        // one decoded copy.
+        std::unique_ptr<FrameSequence> frames{};
+        std::string still{};
+        unsigned error = FrameSequence::open(path, frames, still);
+        std::shared_ptr<const Image> image{};
+        if (error != 0)
+        {
+          res.error = string::f("Error %u: %s", error, FrameSequence::errorText(error));
+          WARN("Pictogram: cannot load %s. %s", path.c_str(), res.error.c_str());
+        }
+        else if (frames)
+          image = decodeFrame(*frames, 0, res.error);
+        else
+          image = ImageCache::instance().get(still, [&]() { return decode(still, res); });
+        if (image)
+        {
+          res.ok = true;
+          res.width = image->width;
+          res.height = image->height;
+          res.frames = frames ? frames->count() : 1;
+          res.image = image;
+        }
+        lock.lock();
+        if (pending) // Outdated before it was finished
+          continue;
+        if (image)
+        {
+          source = frames ? nullptr : image;
+          shown = nullptr;
+          boxPending = true;
+          startSequence(std::move(frames), image);
+        }
+        result = res;
+        loading = false;
+        generation++;
+      }
+    }
+    std::shared_ptr<const Image> decode(const std::string &pngPath, Result &res)
+    {
+      MappedFile file{};
+      std::shared_ptr<Image> image{};
+      lodepng::State state{};
+      state.info_raw.colortype = LCT_RGB;
+      state.info_raw.bitdepth = 8;
+      // Learn the size from the header, then let lodepng write the
+      // pixels straight into the image instead of copying them over
+      unsigned error = file.open(pngPath);
+      if (error == 0)
+        error = lodepng_inspect(&res.width, &res.height, &state, file.data(), file.size());
+      if (error == 0 && size_t(res.width) * res.height > RegionDecoder::MIN_PIXELS &&
+          state.info_png.interlace_method == 0)
+        return decodeRegions(pngPath, res);
+      // 16 bit samples are decoded as they are and only kept until the
+      // planes are made from them
+      std::vector<unsigned char> wide{};
+      if (error == 0 && state.info_png.color.bitdepth == 16)
+        state.info_raw.bitdepth = 16;
+      if (error == 0)
+      {
+        progress = 0.1f;
+        try
+        {
+          size_t size = size_t(res.width) * res.height;
+          image = std::make_shared<Image>();
+          image->pixels.resize(size);
+          for (std::vector<float> &plane : image->planes)
+            plane.resize(size);
+          if (state.info_raw.bitdepth == 16)
+            wide.resize(size * 6);
+        }
+        catch (const std::exception &) // bad_alloc or length_error
+        {
+          error = 83;
+        }
+      }
+      if (error == 0 && !wide.empty())
+        error = lodepng_decode_into(wide.data(), wide.size(), &res.width, &res.height,
+                                    &state, file.data(), file.size());
+      else if (error == 0)
+        error = lodepng_decode_into(reinterpret_cast<unsigned char *>(image->pixels.data()),
+                                    image->pixels.size() * sizeof(RGB), &res.width, &res.height,
+                                    &state, file.data(), file.size());
+      if (error != 0)
+      {
+        res.error = string::f("Error %u: %s", error, lodepng_error_text(error));
+        WARN("Pictogram: cannot load %s. %s", pngPath.c_str(), res.error.c_str());
+        return nullptr;
+      }
+      image->width = res.width;
+      image->height = res.height;
+      image->region = Image::Region{0, 0, res.width, res.height};
+      progress = 0.5f;
+      // All color math happens here, process() only reads the planes
+      size_t size = image->pixels.size();
+      image->bits = wide.empty() ? 8 : 16;
+      calcPlanes(*image, [&](size_t done) { progress = 0.5f + 0.4f * done / size; },
+                 wide.empty() ? nullptr : wide.data());
+      makePreview(*image, PREVIEW_WIDTH, PREVIEW_HEIGHT);
+      progress = 1.f;
+      res.ok = true;
+      return image;
+    }
+    // Decode an image too big to keep decoded: the preview and the
+    // checkpoints are made in one pass, the pixels are dropped
+    std::shared_ptr<const Image> decodeRegions(const std::string &pngPath, Result &res)
+    {
+      std::shared_ptr<Image> image = std::make_shared<Image>();
+      image->regions = std::make_shared<RegionDecoder>();
+      Rect area;
+      ScanSettings settings;
+      unsigned edits;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        area = box;
+        settings = scan;
+        edits = layoutEdits;
+      }
+      // The engine gets the select box as soon as the rows below it
+      // are decoded, not only when the whole image is, unless it was
+      // moved or another image was asked for meanwhile
+      unsigned bottom = clamp(int(std::round(area.y) + std::round(area.h)), 0, int(res.height) - 1);
+      unsigned ready = std::min(res.height, (bottom / RegionDecoder::TILE + 1) * RegionDecoder::TILE) - 1;
+      PreviewBuilder preview(res.width, res.height, PREVIEW_WIDTH, PREVIEW_HEIGHT);
+      unsigned error = image->regions->open(pngPath, area, [&](unsigned y, const RGB *row) {
+        preview.addRow(y, row);
+        progress = 0.1f + 0.9f * (y + 1) / res.height;
+        if (y == ready)
+        {
+          std::shared_ptr<const Image> region = image->regions->crop(area);
+          std::shared_ptr<const ScanPath> path = region ? buildScanPath(region, area, settings) : nullptr;
+          std::lock_guard<std::mutex> lock(mutex);
+          if (path && !pending && edits == layoutEdits)
+            publishStill(path);
+        }
+      });
+      if (error != 0)
+      {
+        res.error = string::f("Error %u: %s", error, lodepng_error_text(error));
+        WARN("Pictogram: cannot load %s. %s", pngPath.c_str(), res.error.c_str());
+        return nullptr;
+      }
+      image->width = res.width;
+      image->height = res.height;
+      image->preview = std::move(preview.preview);
+      image->regionBytes = image->regions->bytes();
+      progress = 1.f;
+      res.ok = true;
+      return image;
+    }
+    void publishStill(std::shared_ptr<const ScanPath> path)
+    {
+      std::shared_ptr<FrameSet> set = std::make_shared<FrameSet>();
+      set->layout = ++layout;
+      set->paths.push_back(path);
+      publisher.publish(set);
+    }
+    // Called with the mutex held. A null sequence drops the animation.
+    void startSequence(std::unique_ptr<FrameSequence> frames, std::shared_ptr<const Image> first)
+    {
+      sequence = std::move(frames);
+      resident.clear();
+      framePaths.clear();
+      windowFirst = UINT_MAX;
+      delays = nullptr;
+      if (!sequence)
+        return;
+      resident[0] = first;
+      size_t frameBytes = std::max<size_t>(first->bytes(), 1);
+      windowSize = std::min<size_t>(std::max<size_t>(WINDOW_BYTES / frameBytes, MIN_WINDOW), MAX_WINDOW);
+      if (!sequence->isFolder())
+      {
+        std::shared_ptr<std::vector<float>> seconds = std::make_shared<std::vector<float>>();
+        for (unsigned i = 0; i < sequence->count(); i++)
+          seconds->push_back(sequence->getDelay(i));
+        delays = seconds;
+      }
+    }
+    // Pixels, planes and preview of a frame, null if it cannot be decoded
+    std::shared_ptr<const Image> decodeFrame(FrameSequence &frames, unsigned frame, std::string &error)
+    {
+      std::shared_ptr<Image> image = std::make_shared<Image>();
+      unsigned code = frames.decode(frame, *image);
+      if (code == 0)
+      {
+        try
+        {
+          for (std::vector<float> &plane : image->planes)
+            plane.resize(image->pixels.size());
+        }
+        catch (const std::exception &) // bad_alloc
+        {
+          code = 83;
+        }
+      }
+      if (code != 0)
+      {
+        error = string::f("Error %u: %s", code, FrameSequence::errorText(code));
+        WARN("Pictogram: cannot decode frame %u. %s", frame, error.c_str());
+        return nullptr;
+      }
+      calcPlanes(*image);
+      makePreview(*image, PREVIEW_WIDTH, PREVIEW_HEIGHT);
+      return image;
+    }
+    /*
+      Called with the mutex held while an animation is loaded. Moves
+      the window to the frame the engine wants and decodes the next
+      missing frame of it. Returns false if there was nothing to do.
+    */
+    bool stepSequence(std::unique_lock<std::mutex> &lock)
+    {
+      unsigned count = sequence->count();
+      unsigned first = wanted % count;
+      unsigned size = std::min(count, windowSize);
+      auto outside = [&](unsigned frame) { return (frame + count - first) % count >= size; };
+      if (first != windowFirst)
+      {
+        // Frames behind the window are freed once the engine let go of them
+        windowFirst = first;
+        for (auto it = resident.begin(); it != resident.end();)
+          it = outside(it->first) ? resident.erase(it) : std::next(it);
+        for (auto it = framePaths.begin(); it != framePaths.end();)
+          it = outside(it->first) ? framePaths.erase(it) : std::next(it);
+        publishSequence();
+        return true;
+      }
+      for (unsigned i = 0; i < size; i++)
+      {
+        unsigned frame = (first + i) % count;
+        if (framePaths.count(frame))
+          continue;
+        auto it = resident.find(frame);
+        std::shared_ptr<const Image> image = it != resident.end() ? it->second : nullptr;
+        Rect area = box;
+        ScanSettings settings = scan;
+        lock.unlock();
+        std::string error{};
+        if (!image)
+          image = decodeFrame(*sequence, frame, error);
+        std::shared_ptr<const ScanPath> path = image ? buildScanPath(image, area, settings) : nullptr;
+        lock.lock();
+        if (pending || boxPending || scanPending) // Outdated, the loop starts over
+          return true;
+        // A frame that cannot be decoded keeps a null path, it is not tried again
+        if (image)
+          resident[frame] = image;
+        framePaths[frame] = path;
+        publishSequence();
+        return true;
+      }
+      return false;
+    }
+    // The window as far as it is decoded. Not before its first frame
+    // is, until then the engine keeps the window it has.
+    void publishSequence()
+    {
+      if (!framePaths.count(windowFirst))
+        return;
+      unsigned count = sequence->count();
+      std::shared_ptr<FrameSet> set = std::make_shared<FrameSet>();
+      set->count = count;
+      set->first = windowFirst;
+      set->layout = layout;
+      set->delays = delays;
+      for (unsigned i = 0; i < std::min(count, windowSize); i++)
+      {
+        auto it = framePaths.find((windowFirst + i) % count);
+        set->paths.push_back(it != framePaths.end() ? it->second : nullptr);
+      }
+      publisher.publish(set);
+    }
+  };
+};
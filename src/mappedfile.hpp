@@ -0,0 +1,103 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "dep/lodepng/lodepng.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifndef ARCH_WIN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace thm
+{
+  /*
+    Read only view of a whole file for the decoder. The file is mapped
+    into memory where the OS supports it, so the compressed bytes are
+    paged in straight from the file cache instead of being copied to
+    the heap. If mapping fails (or on Windows) it is read into a buffer.
+  */
+  struct MappedFile
+  {
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
+    {
+      close();
+    }
+    // Returns 0 or a lodepng error code
+    unsigned open(const std::string &path)
+    {
+      close();
+#ifndef ARCH_WIN
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd >= 0)
+      {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+          void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (p != MAP_FAILED)
+          {
+            // The decoder reads the file once, front to back
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            map = p;
+            mapSize = st.st_size;
+          }
+        }
+        ::close(fd);
+        if (map)
+          return 0;
+      }
+#endif
+      return lodepng::load_file(buffer, path);
+    }
+    void close()
+    {
+#ifndef ARCH_WIN
+      if (map)
+        munmap(map, mapSize);
+#endif
+      map = nullptr;
+      mapSize = 0;
+      buffer.clear();
+      buffer.shrink_to_fit();
+    }
+    const unsigned char *data() const
+    {
+      return map ? static_cast<const unsigned char *>(map) : buffer.data();
+    }
+    size_t size() const
+    {
+      return map ? mapSize : buffer.size();
+    }
+
+  private:
+    void *map{nullptr};
+    size_t mapSize{0};
+    std::vector<unsigned char> buffer{};
+  };
+};
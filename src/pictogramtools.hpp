@@ -24,7 +24,14 @@
 // https : //www.niwa.nu/2013/05/math-behind-colorspace-conversions-rgb-hsl/
 
 #include "plugin.hpp"
+#include "workerpool.hpp"
+#include <atomic>
 #include <cmath>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifdef ARCH_WIN
 using uint = unsigned int;
@@ -49,83 +56,309 @@ namespace thm
   { // red green and blue
     uint8_t r, g, b;
   };
+  // lodepng writes LCT_RGB pixels straight into Image::pixels
+  static_assert(sizeof(RGB) == 3, "RGB must match the packed 8 bit RGB layout");
   
-  //Encapsulate working with the rgb-data of an Image
+  struct RegionDecoder;
+
+  // Decoded pixels of one image. Never changed after it was published.
+  struct Image
+  {
+    // Color planes, in the order of the Pictogram outputs
+    enum Plane { RED, GREEN, BLUE, HUE, SAT, LUM, PLANES };
+    uint width{};
+    uint height{};
+    // The part of the image the pixels cover. All of it, unless the
+    // image is too big and decoded region by region.
+    struct Region
+    {
+      uint x, y, width, height;
+    } region{};
+    std::vector<RGB> pixels{};
+    // One value 0..1 per pixel, indexed like pixels. Filled by the loader.
+    std::vector<float> planes[PLANES]{};
+    // Bits per sample the planes were made from. The pixels are always
+    // 8 bits, of 16 bit images their high bytes.
+    uint bits{8};
+    // RGBA copy for nvgCreateImageRGBA(), so the display shows the very
+    // pixels the module outputs without decoding the file again. Big
+    // images are box filtered down to the display size.
+    struct Preview
+    {
+      int width{};
+      int height{};
+      std::vector<uint8_t> rgba{};
+    } preview{};
+    // Set for images too big to decode as a whole, which are decoded
+    // in regions from it instead. See RegionDecoder::bytes()
+    std::shared_ptr<RegionDecoder> regions{};
+    size_t regionBytes{};
+    // Memory held by the pixels, the planes, the preview and the regions
+    size_t bytes() const
+    {
+      return pixels.size() * (sizeof(RGB) + PLANES * sizeof(float)) + preview.rgba.size() + regionBytes;
+    }
+  };
+
+  // Orders in which the engine walks the pixels of the select box
+  enum ScanOrder
+  {
+    SCAN_ROWS,     // Left to right, top to bottom
+    SCAN_SNAKE,    // Rows, every other one right to left
+    SCAN_COLUMNS,  // Top to bottom, left to right
+    SCAN_SPIRAL,   // Clockwise from the border inwards
+    SCAN_HILBERT,  // Hilbert curve, neighbours stay close
+    SCAN_DIAGONAL, // Diagonals from the top left corner
+    SCAN_RANDOM,   // Every pixel once, shuffled by a seed
+    SCAN_ORDERS_LEN
+  };
+
+  /*
+    The pixels of the select box in scan order, as indexes into an
+    image. Built by the loader whenever the image, the box or the
+    order changes, so process() only walks an array.
+  */
+  struct ScanPath
+  {
+    std::shared_ptr<const Image> image{};
+    std::vector<uint32_t> order{};
+    // The box in region coordinates, for reading parallel rows and
+    // for reading at X/Y CV
+    uint width{}; // Row length of the image region
+    uint left{};
+    uint top{};
+    uint columns{};
+    uint rows{};
+    // Summed-area tables of the box, (columns + 1) x (rows + 1) with a
+    // zero first row and column, for averages in four lookups. Only
+    // built while the module averages. The planes count in steps of
+    // 1/sumSteps, so a box of up to 2^32 / sumSteps pixels sums without
+    // overflow and unsigned wrap-around keeps the differences exact.
+    std::vector<uint32_t> sums[Image::PLANES]{};
+    uint sumSteps{255};
+    // Rows or columns of the box as single-cycle waves of WAVE_SIZE
+    // samples, one band-limited copy per level: level l keeps the
+    // first WAVE_HARMONICS >> l harmonics. Laid out [wave][level][sample].
+    // Only built while the module is an oscillator, see buildWaves().
+    enum { WAVE_SIZE = 1024, WAVE_HARMONICS = 512, WAVE_LEVELS = 10, MAX_WAVES = 64 };
+    uint waveCount{};
+    std::vector<float> waves[Image::PLANES]{};
+  };
+
+  //Encapsulate the position of the engine inside an Image
   struct RGBData
   {
-    RGB color{};
-    Rect selectBox{};
-    void clear()
+    void setPath(const ScanPath *p)
     {
-      vrgb.clear();
-      vrgb.reserve(0);
-      yDelta = 0;
+      path = p;
+      image = p ? p->image.get() : nullptr;
+      order = p ? p->order.data() : nullptr;
+      size = p ? p->order.size() : 0;
+      resetPosition();
+    }
+    // Another frame of an animation under the same box and order:
+    // the scan goes on where it was
+    void setFrame(const ScanPath *p)
+    {
+      uint at = pos;
+      setPath(p);
+      if (at < size)
+        pos = at;
     }
-    void addColor()
+    const ScanPath *getPath() const
     {
-      vrgb.emplace_back(color);
-      //vrgb.push_back(color);
+      return path;
     }
     void resetPosition()
     {
-      imgWidth = std::round(r.imagewidth);
-      rx = std::round(r.x);
-      ry = std::round(r.y);
-      rw = std::round(r.w);
-      rh = std::round(r.h);
-      // Left upper pixel of the selectbox
-      pixelindex = rx + ry * imgWidth;
-      // Right upper pixel of the selectbox
-      rightTop = pixelindex + rw;
-      rightPos = rightTop;
-      yDelta = 0;
-    }
-    void resetPosition(float imageWidth)
-    {
-      selectBox.imagewidth = imageWidth;
-      resetPosition();
+      pos = 0;
     }
-    //Navigate through the vector inside the boundaries of the selectBox
+    // Step along the scan path, back to its start after the last pixel
     void nextPixel() // called by module->process()
     {
-      //DEBUG(string::f("Thm: pixindex %d red %d", pixelindex, vrgb[pixelindex].r).c_str());
-      if (++pixelindex >= vrgb.size())
-        resetPosition();
-      if (pixelindex == rightPos)
-      {
-        pixelindex += imgWidth - rw;
-        rightPos += imgWidth;
-        if (yDelta++ == rh)
-          resetPosition();
-      }
+      uint next = pos + 1;
+      pos = next < size ? next : 0;
     }
-    bool isEmpty()
+    // Also true while the box is outside the region an image holds
+    bool isEmpty() const
     {
-      return vrgb.empty();
+      return size == 0;
     }
-    void reserve(size_t size)
+    // Pixel index of the current pixel, or of the pixel row rows below
+    // it. Rows past the bottom of the select box wrap to its top.
+    uint getIndex(uint row = 0) const
     {
-      vrgb.reserve(size);
+      uint index = order[pos];
+      if (row)
+      {
+        uint y = index / path->width;
+        uint target = path->top + (y - path->top + row) % path->rows;
+        index = index - y * path->width + target * path->width;
+      }
+      return index;
     }
-    const RGB &getColor() const
+    // Plane value 0..1 of that pixel
+    float getPlane(int plane, uint row = 0) const
     {
-      return vrgb[pixelindex];
+      return image->planes[plane][getIndex(row)];
     }
 
   private:
-    std::vector<RGB> vrgb{};
-    const Rect &r = selectBox;
-    uint pixelindex{};
-    uint yDelta{};
-    uint rightTop{};
-    uint rightPos{};
-    uint imgWidth{};
-    uint rx{};
-    uint ry{};
-    uint rw{};
-    uint rh{};
+    const ScanPath *path{nullptr};
+    const Image *image{nullptr};
+    const uint32_t *order{nullptr};
+    uint size{};
+    uint pos{};
   };
 
+  // How planes are read between pixels at X/Y CV
+  enum Interpolation
+  {
+    INTERP_NEAREST,
+    INTERP_BILINEAR,
+    INTERP_BICUBIC, // Catmull-Rom
+    INTERPOLATIONS_LEN
+  };
+
+  /*
+    Plane values at a point of the select box, x and y 0..1 from its
+    left upper to its right lower pixel. The taps and weights are
+    worked out once and shared by all planes, so this is cheap enough
+    for every channel of every sample.
+  */
+  inline void samplePlanes(const ScanPath &path, float x, float y, int mode, float values[Image::PLANES])
+  {
+    const Image &image = *path.image;
+    float fx = clamp(x, 0.f, 1.f) * (path.columns - 1);
+    float fy = clamp(y, 0.f, 1.f) * (path.rows - 1);
+    if (mode == INTERP_NEAREST)
+    {
+      size_t index = size_t(path.top + uint(fy + 0.5f)) * path.width + path.left + uint(fx + 0.5f);
+      for (int p = 0; p < Image::PLANES; p++)
+        values[p] = image.planes[p][index];
+      return;
+    }
+    int ix = int(fx);
+    int iy = int(fy);
+    float tx = fx - ix;
+    float ty = fy - iy;
+    // Taps at the box border repeat the border pixels
+    int taps = 2, first = 0;
+    float wx[4], wy[4];
+    if (mode == INTERP_BICUBIC)
+    {
+      taps = 4;
+      first = -1;
+      auto weights = [](float t, float w[4]) {
+        float t2 = t * t, t3 = t2 * t;
+        w[0] = 0.5f * (-t3 + 2.f * t2 - t);
+        w[1] = 0.5f * (3.f * t3 - 5.f * t2 + 2.f);
+        w[2] = 0.5f * (-3.f * t3 + 4.f * t2 + t);
+        w[3] = 0.5f * (t3 - t2);
+      };
+      weights(tx, wx);
+      weights(ty, wy);
+    }
+    else
+    {
+      wx[0] = 1.f - tx;
+      wx[1] = tx;
+      wy[0] = 1.f - ty;
+      wy[1] = ty;
+    }
+    size_t columns[4], rows[4];
+    for (int k = 0; k < taps; k++)
+    {
+      columns[k] = path.left + clamp(ix + first + k, 0, int(path.columns) - 1);
+      rows[k] = size_t(path.top + clamp(iy + first + k, 0, int(path.rows) - 1)) * path.width;
+    }
+    for (int p = 0; p < Image::PLANES; p++)
+    {
+      const float *plane = image.planes[p].data();
+      float sum = 0.f;
+      for (int j = 0; j < taps; j++)
+      {
+        float row = 0.f;
+        for (int k = 0; k < taps; k++)
+          row += wx[k] * plane[rows[j] + columns[k]];
+        sum += wy[j] * row;
+      }
+      // Bicubic overshoots at hard edges
+      values[p] = clamp(sum, 0.f, 1.f);
+    }
+  }
+
+  /*
+    Mean plane values of the pixels at most radius pixels away from the
+    pixel index, within the select box. Reads the pixel itself until
+    the loader has built the summed-area tables.
+  */
+  inline void averagePlanes(const ScanPath &path, uint index, uint radius, float values[Image::PLANES])
+  {
+    if (path.sums[0].empty())
+    {
+      for (int p = 0; p < Image::PLANES; p++)
+        values[p] = path.image->planes[p][index];
+      return;
+    }
+    uint x = index % path.width - path.left;
+    uint y = index / path.width - path.top;
+    uint x0 = x - std::min(x, radius);
+    uint y0 = y - std::min(y, radius);
+    uint x1 = std::min(path.columns - 1, x + std::min(radius, path.columns)) + 1;
+    uint y1 = std::min(path.rows - 1, y + std::min(radius, path.rows)) + 1;
+    size_t stride = path.columns + 1;
+    size_t a = y0 * stride + x0, b = y0 * stride + x1;
+    size_t c = y1 * stride + x0, d = y1 * stride + x1;
+    float scale = 1.f / (float(path.sumSteps) * (x1 - x0) * (y1 - y0));
+    for (int p = 0; p < Image::PLANES; p++)
+    {
+      const uint32_t *sum = path.sums[p].data();
+      values[p] = (sum[d] - sum[b] - sum[c] + sum[a]) * scale;
+    }
+  }
+
+  /*
+    One sample of every plane of the wave bank, at phase 0..1 of the
+    cycle. position 0..1 crossfades from the first wave to the last.
+    level is the mipmap that keeps below Nyquist, see waveLevel().
+    Zero without waves, when the bank could not be built.
+  */
+  inline void sampleWaves(const ScanPath &path, float phase, float position, int level,
+                          float values[Image::PLANES])
+  {
+    if (path.waveCount == 0)
+    {
+      std::fill(values, values + Image::PLANES, 0.f);
+      return;
+    }
+    float w = clamp(position, 0.f, 1.f) * (path.waveCount - 1);
+    uint w0 = std::min(uint(w), path.waveCount - 1);
+    uint w1 = std::min(w0 + 1, path.waveCount - 1);
+    float fade = w - w0;
+    float x = phase * ScanPath::WAVE_SIZE;
+    uint i0 = uint(x) & (ScanPath::WAVE_SIZE - 1);
+    uint i1 = (i0 + 1) & (ScanPath::WAVE_SIZE - 1);
+    float t = x - std::floor(x);
+    size_t a = (size_t(w0) * ScanPath::WAVE_LEVELS + level) * ScanPath::WAVE_SIZE;
+    size_t b = (size_t(w1) * ScanPath::WAVE_LEVELS + level) * ScanPath::WAVE_SIZE;
+    for (int p = 0; p < Image::PLANES; p++)
+    {
+      const float *wave = path.waves[p].data();
+      float va = wave[a + i0] + t * (wave[a + i1] - wave[a + i0]);
+      float vb = wave[b + i0] + t * (wave[b + i1] - wave[b + i0]);
+      values[p] = va + fade * (vb - va);
+    }
+  }
+  // The first mipmap level without harmonics above half the sample rate
+  inline int waveLevel(float freq, float sampleRate)
+  {
+    float ratio = 2.f * ScanPath::WAVE_HARMONICS * freq / sampleRate;
+    if (ratio <= 1.f)
+      return 0;
+    return std::min(int(std::ceil(std::log2(ratio))), int(ScanPath::WAVE_LEVELS) - 1);
+  }
+
   // Calculate and hold rgb- and hsv values
   struct ColorSpace
   {
@@ -142,9 +375,11 @@ namespace thm
       float min = std::min({r, g, b});
       float max = std::max({r, g, b});
       //Luminance in percent
-      lum = max + min / 2.f; 
-      //Saturation in percent
-      if (lum <= 0.5f)
+      lum = (max + min) / 2.f;
+      //Saturation in percent. Grey has none, black and white would divide by zero.
+      if (max == min)
+        sat = 0.f;
+      else if (lum <= 0.5f)
         sat = (max - min) / (max + min);
       else
         sat = (max - min) / (2.f - max - min);
@@ -168,6 +403,278 @@ namespace thm
     }
   };
 
+  /*
+    Batch version of ColorSpace::calc, four pixels per step with
+    rack::simd (SSE, NEON on ARM) and no branches. Reads n values of
+    the red, green and blue planes and writes hue, saturation and
+    luminance, all 0..1. Divisions use rcp plus one Newton step.
+  */
+  inline void calcHSL(const float *red, const float *green, const float *blue,
+                      float *hue, float *sat, float *lum, size_t n)
+  {
+    using simd::float_4;
+    auto reciprocal = [](float_4 x) {
+      float_4 y = simd::rcp(x);
+      return y * (2.f - x * y);
+    };
+    for (size_t i = 0; i < n; i += 4)
+    {
+      float_4 r, g, b;
+      float tail[3][4]{};
+      if (i + 4 <= n)
+      {
+        r = float_4::load(red + i);
+        g = float_4::load(green + i);
+        b = float_4::load(blue + i);
+      }
+      else
+      {
+        std::copy(red + i, red + n, tail[0]);
+        std::copy(green + i, green + n, tail[1]);
+        std::copy(blue + i, blue + n, tail[2]);
+        r = float_4::load(tail[0]);
+        g = float_4::load(tail[1]);
+        b = float_4::load(tail[2]);
+      }
+      float_4 max = simd::fmax(simd::fmax(r, g), b);
+      float_4 min = simd::fmin(simd::fmin(r, g), b);
+      float_4 delta = max - min;
+      float_4 grey = (delta == 0.f);
+      float_4 l = (max + min) * 0.5f;
+      float_4 s = delta * reciprocal(simd::ifelse(l <= 0.5f, max + min, 2.f - max - min));
+      s = simd::ifelse(grey, float_4::zero(), simd::clamp(s, float_4(0.f), float_4(1.f)));
+      // Hue sector of the largest channel, blue wins ties like in calc()
+      float_4 rd = reciprocal(delta);
+      float_4 h = simd::ifelse(b == max, 4.f + (r - g) * rd,
+                               simd::ifelse(g == max, 2.f + (b - r) * rd, (g - b) * rd));
+      h *= 1.f / 6.f;
+      h += simd::ifelse(h < 0.f, float_4(1.f), float_4::zero());
+      h = simd::ifelse(grey, float_4::zero(), h);
+      if (i + 4 <= n)
+      {
+        h.store(hue + i);
+        s.store(sat + i);
+        l.store(lum + i);
+      }
+      else
+      {
+        h.store(tail[0]);
+        s.store(tail[1]);
+        l.store(tail[2]);
+        std::copy(tail[0], tail[0] + (n - i), hue + i);
+        std::copy(tail[1], tail[1] + (n - i), sat + i);
+        std::copy(tail[2], tail[2] + (n - i), lum + i);
+      }
+    }
+  }
+
+  /*
+    Halve an RGBA image of w x h pixels with a 2x2 box filter, four
+    pixels per step with SSE2 or NEON. An odd last row or column is
+    averaged with itself.
+  */
+  inline void halveRGBA(const uint8_t *in, int w, int h, std::vector<uint8_t> &out)
+  {
+    int ow = (w + 1) / 2;
+    int oh = (h + 1) / 2;
+    out.resize(size_t(ow) * oh * 4);
+    for (int y = 0; y < oh; y++)
+    {
+      const uint8_t *r0 = in + size_t(2 * y) * w * 4;
+      const uint8_t *r1 = in + size_t(std::min(2 * y + 1, h - 1)) * w * 4;
+      uint8_t *o = out.data() + size_t(y) * ow * 4;
+      int x = 0;
+#if defined(__SSE2__)
+      for (; x + 4 <= w / 2; x += 4)
+      {
+        __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(r0 + x * 8)),
+                                 _mm_loadu_si128((const __m128i *)(r1 + x * 8)));
+        __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(r0 + x * 8 + 16)),
+                                 _mm_loadu_si128((const __m128i *)(r1 + x * 8 + 16)));
+        __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_si128((__m128i *)(o + x * 4), _mm_avg_epu8(_mm_castps_si128(even), _mm_castps_si128(odd)));
+      }
+#elif defined(__ARM_NEON)
+      for (; x + 4 <= w / 2; x += 4)
+      {
+        uint32x4x2_t a = vld2q_u32((const uint32_t *)(r0 + x * 8));
+        uint32x4x2_t b = vld2q_u32((const uint32_t *)(r1 + x * 8));
+        uint8x16_t top = vrhaddq_u8(vreinterpretq_u8_u32(a.val[0]), vreinterpretq_u8_u32(a.val[1]));
+        uint8x16_t bottom = vrhaddq_u8(vreinterpretq_u8_u32(b.val[0]), vreinterpretq_u8_u32(b.val[1]));
+        vst1q_u8(o + x * 4, vrhaddq_u8(top, bottom));
+      }
+#endif
+      for (; x < ow; x++)
+      {
+        int x0 = 2 * x * 4;
+        int x1 = std::min(2 * x + 1, w - 1) * 4;
+        for (int c = 0; c < 4; c++)
+          o[x * 4 + c] = (r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) / 4;
+      }
+    }
+  }
+
+  /*
+    Build the display texture of an image from its pixels. Images
+    bigger than maxWidth x maxHeight are halved until they fit, the
+    first step straight from the RGB pixels so a full size RGBA copy
+    never exists.
+  */
+  inline void makePreview(Image &image, int maxWidth, int maxHeight)
+  {
+    int w = image.width;
+    int h = image.height;
+    std::vector<uint8_t> level{};
+    if (w <= maxWidth && h <= maxHeight)
+    {
+      level.resize(image.pixels.size() * 4);
+      uint8_t *out = level.data();
+      for (const RGB &p : image.pixels)
+      {
+        *out++ = p.r;
+        *out++ = p.g;
+        *out++ = p.b;
+        *out++ = 255;
+      }
+    }
+    else
+    {
+      int ow = (w + 1) / 2;
+      int oh = (h + 1) / 2;
+      level.resize(size_t(ow) * oh * 4);
+      uint8_t *out = level.data();
+      for (int y = 0; y < oh; y++)
+      {
+        const RGB *r0 = &image.pixels[size_t(2 * y) * w];
+        const RGB *r1 = &image.pixels[size_t(std::min(2 * y + 1, h - 1)) * w];
+        for (int x = 0; x < ow; x++)
+        {
+          int x0 = 2 * x;
+          int x1 = std::min(2 * x + 1, w - 1);
+          *out++ = (r0[x0].r + r0[x1].r + r1[x0].r + r1[x1].r + 2) / 4;
+          *out++ = (r0[x0].g + r0[x1].g + r1[x0].g + r1[x1].g + 2) / 4;
+          *out++ = (r0[x0].b + r0[x1].b + r1[x0].b + r1[x1].b + 2) / 4;
+          *out++ = 255;
+        }
+      }
+      w = ow;
+      h = oh;
+      std::vector<uint8_t> next{};
+      while (w > maxWidth || h > maxHeight)
+      {
+        halveRGBA(level.data(), w, h, next);
+        level.swap(next);
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+      }
+    }
+    image.preview.width = w;
+    image.preview.height = h;
+    image.preview.rgba = std::move(level);
+  }
+
+  /*
+    makePreview for images that are never held as a whole. Takes the
+    rows one by one and averages blocks of factor x factor pixels,
+    factor the smallest power of two that fits the image into
+    maxWidth x maxHeight. Blocks at the right and bottom edge average
+    the pixels they have.
+  */
+  struct PreviewBuilder
+  {
+    PreviewBuilder(int width, int height, int maxWidth, int maxHeight) : width(width), height(height)
+    {
+      while ((width + factor - 1) / factor > maxWidth || (height + factor - 1) / factor > maxHeight)
+        factor *= 2;
+      preview.width = (width + factor - 1) / factor;
+      preview.height = (height + factor - 1) / factor;
+      preview.rgba.resize(size_t(preview.width) * preview.height * 4);
+      sums.resize(size_t(preview.width) * 3);
+    }
+    void addRow(int y, const RGB *row)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        uint32_t *sum = &sums[size_t(x / factor) * 3];
+        sum[0] += row[x].r;
+        sum[1] += row[x].g;
+        sum[2] += row[x].b;
+      }
+      if ((y + 1) % factor != 0 && y + 1 != height)
+        return;
+      int rows = y % factor + 1;
+      uint8_t *out = &preview.rgba[size_t(y / factor) * preview.width * 4];
+      for (int x = 0; x < preview.width; x++)
+      {
+        uint32_t n = uint32_t(std::min(factor, width - x * factor)) * rows;
+        for (int c = 0; c < 3; c++)
+          *out++ = (sums[x * 3 + c] + n / 2) / n;
+        *out++ = 255;
+      }
+      std::fill(sums.begin(), sums.end(), 0);
+    }
+    Image::Preview preview{};
+
+  private:
+    int width;
+    int height;
+    int factor{1};
+    std::vector<uint32_t> sums{};
+  };
+
+  /*
+    Fill the color planes of the pixels [begin, end). wide, if given,
+    are the 16 bit big endian RGB samples of a 16 bit image: the planes
+    are made from those, the pixels from their high bytes.
+  */
+  inline void calcPlanes(Image &image, size_t begin, size_t end, const uint8_t *wide = nullptr)
+  {
+    float *planes[Image::PLANES];
+    for (int p = 0; p < Image::PLANES; p++)
+      planes[p] = image.planes[p].data() + begin;
+    if (wide)
+      for (size_t i = begin; i < end; i++)
+      {
+        const uint8_t *s = wide + i * 6;
+        image.pixels[i] = RGB{s[0], s[2], s[4]};
+        planes[Image::RED][i - begin] = (s[0] << 8 | s[1]) / 65535.f;
+        planes[Image::GREEN][i - begin] = (s[2] << 8 | s[3]) / 65535.f;
+        planes[Image::BLUE][i - begin] = (s[4] << 8 | s[5]) / 65535.f;
+      }
+    else
+      for (size_t i = begin; i < end; i++)
+      {
+        planes[Image::RED][i - begin] = image.pixels[i].r / 255.f;
+        planes[Image::GREEN][i - begin] = image.pixels[i].g / 255.f;
+        planes[Image::BLUE][i - begin] = image.pixels[i].b / 255.f;
+      }
+    calcHSL(planes[Image::RED], planes[Image::GREEN], planes[Image::BLUE],
+            planes[Image::HUE], planes[Image::SAT], planes[Image::LUM], end - begin);
+  }
+
+  /*
+    Fill all color planes, blocks of pixels side by side on the worker
+    pool. onBlock, if given, gets the number of pixels done so far
+    after each block, from the thread that did the block. See above
+    for wide.
+  */
+  inline void calcPlanes(Image &image, const std::function<void(size_t)> &onBlock = nullptr,
+                         const uint8_t *wide = nullptr)
+  {
+    const size_t block = size_t(1) << 16;
+    size_t size = image.pixels.size();
+    std::atomic<size_t> done{0};
+    WorkerPool::instance().parallelFor((size + block - 1) / block, [&](size_t i) {
+      size_t begin = i * block;
+      size_t end = std::min(size, begin + block);
+      calcPlanes(image, begin, end, wide);
+      size_t total = done += end - begin;
+      if (onBlock)
+        onBlock(total);
+    });
+  }
+
   /*
     Drawing a box on the loaded image that serves as
     an area to choose pixels from.
@@ -0,0 +1,362 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "pictogramtools.hpp"
+#include "mappedfile.hpp"
+#include "dep/lodepng/lodepng.h"
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace thm
+{
+  /*
+    Decodes parts of a PNG that is too big to keep decoded as a whole.
+    open() decodes all rows once, for the preview, and saves inflate
+    checkpoints every TILE rows on the way. crop() decodes only the
+    rows of the select box again, starting at the checkpoint above
+    them. Decoded tiles of TILE x TILE pixels stay in a small LRU
+    cache, so moving the box a little does not decode the same rows
+    again. The file is only mapped while open() runs, its image data
+    is kept on the heap, so a file changed on disk later on cannot
+    fault crop(). Safe to use from several loader threads at once.
+  */
+  struct RegionDecoder
+  {
+    // Images with more pixels are decoded region by region
+    static constexpr size_t MIN_PIXELS = size_t(1) << 24;
+    // Largest region crop() returns, bigger select boxes are cut at the bottom
+    static constexpr size_t MAX_REGION_PIXELS = size_t(1) << 22;
+    static constexpr unsigned TILE = 256;
+    static constexpr size_t TILE_BUDGET = size_t(64) << 20;
+    using RowHandler = std::function<void(unsigned y, const RGB *row)>;
+
+    RegionDecoder()
+    {
+      lodepng_row_index_init(&index);
+      index.interval = TILE;
+      state.info_raw.colortype = LCT_RGB;
+      state.info_raw.bitdepth = 8;
+    }
+    ~RegionDecoder()
+    {
+      lodepng_row_index_cleanup(&index);
+    }
+    RegionDecoder(const RegionDecoder &) = delete;
+    RegionDecoder &operator=(const RegionDecoder &) = delete;
+
+    /*
+      Decode all rows of path and hand them to onRow. The tiles under
+      box are kept on the way, so crop(box) needs no second decode.
+      Returns 0 or a lodepng error code.
+    */
+    unsigned open(const std::string &path, const Rect &box, const RowHandler &handler)
+    {
+      MappedFile file{};
+      unsigned error = file.open(path);
+      if (error == 0)
+        error = lodepng_inspect(&width, &height, &state, file.data(), file.size());
+      if (error != 0)
+        return error;
+      Image::Region area = clip(box);
+      Cutter cutter(this, &handler, area.y / TILE, (area.y + area.height - 1) / TILE);
+      for (unsigned tx = area.x / TILE; tx <= (area.x + area.width - 1) / TILE; tx++)
+        cutter.columns.push_back(tx);
+      error = lodepng_decode_rows(&width, &height, &state, file.data(), file.size(), &index,
+                                  &Cutter::onRow, &cutter);
+      if (error == 0)
+        error = cutter.error;
+      if (error == 0)
+        error = copyImageData(file.data(), file.size());
+      return error;
+    }
+    /*
+      The pixels and planes of the select box, or null if decoding
+      failed. Rows that are not cached are decoded from the checkpoint
+      above them.
+    */
+    std::shared_ptr<const Image> crop(const Rect &box)
+    {
+      Image::Region area = clip(box);
+      std::shared_ptr<Image> image = std::make_shared<Image>();
+      image->width = width;
+      image->height = height;
+      image->region = area;
+      try
+      {
+        size_t size = size_t(area.width) * area.height;
+        image->pixels.resize(size);
+        for (std::vector<float> &plane : image->planes)
+          plane.resize(size);
+      }
+      catch (const std::exception &) // bad_alloc or length_error
+      {
+        WARN("Pictogram: no memory for a %ux%u region", area.width, area.height);
+        return nullptr;
+      }
+      // Bands of TILE rows are independent from their checkpoints on,
+      // the worker pool decodes them side by side
+      unsigned tx0 = area.x / TILE;
+      unsigned tx1 = (area.x + area.width - 1) / TILE;
+      unsigned ty0 = area.y / TILE;
+      unsigned ty1 = (area.y + area.height - 1) / TILE;
+      std::atomic<unsigned> failed{0};
+      WorkerPool::instance().parallelFor(ty1 - ty0 + 1, [&](size_t i) {
+        unsigned ty = ty0 + i;
+        std::vector<std::shared_ptr<const Tile>> band(tx1 - tx0 + 1);
+        Cutter cutter(this, nullptr, ty, ty);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          for (unsigned tx = tx0; tx <= tx1; tx++)
+          {
+            band[tx - tx0] = findTile(tx, ty);
+            if (!band[tx - tx0])
+              cutter.columns.push_back(tx);
+          }
+        }
+        if (!cutter.columns.empty())
+        {
+          unsigned top = ty * TILE;
+          unsigned error = lodepng_decode_row_range(top, top + tileHeight(ty), &state, png.data(), png.size(),
+                                                    &index, &Cutter::onRow, &cutter);
+          if (error == 0)
+            error = cutter.error;
+          if (error != 0)
+          {
+            WARN("Pictogram: cannot decode rows %u to %u. Error %u: %s", top, top + tileHeight(ty),
+                 error, lodepng_error_text(error));
+            failed = error;
+            return;
+          }
+          for (size_t c = 0; c < cutter.columns.size(); c++)
+            band[cutter.columns[c] - tx0] = cutter.tiles[c];
+        }
+        // Copy the rows of this band that lie in the region
+        unsigned y0 = std::max(area.y, ty * TILE);
+        unsigned y1 = std::min(area.y + area.height, ty * TILE + tileHeight(ty));
+        for (unsigned y = y0; y < y1; y++)
+        {
+          RGB *out = &image->pixels[size_t(y - area.y) * area.width];
+          for (unsigned tx = tx0; tx <= tx1; tx++)
+          {
+            unsigned x0 = std::max(area.x, tx * TILE);
+            unsigned x1 = std::min(area.x + area.width, tx * TILE + tileWidth(tx));
+            const RGB *in = &band[tx - tx0]->pixels[size_t(y - ty * TILE) * tileWidth(tx) + (x0 - tx * TILE)];
+            std::copy(in, in + (x1 - x0), out + (x0 - area.x));
+          }
+        }
+      });
+      if (failed)
+        return nullptr;
+      calcPlanes(*image);
+      return image;
+    }
+    uint getWidth() const
+    {
+      return width;
+    }
+    uint getHeight() const
+    {
+      return height;
+    }
+    // Memory of the image data, the checkpoints and the tile cache counted full
+    size_t bytes() const
+    {
+      size_t size = TILE_BUDGET + png.size();
+      size_t linebytes = lodepng_get_raw_size(width, 1, &state.info_png.color);
+      for (size_t i = 0; i < index.count; i++)
+        size += index.checkpoints[i].windowsize + linebytes;
+      return size;
+    }
+
+  private:
+    struct Tile
+    {
+      std::vector<RGB> pixels{};
+    };
+    struct CachedTile
+    {
+      uint64_t key;
+      std::shared_ptr<const Tile> tile;
+    };
+    /*
+      Cuts the decoded rows of the bands ty0 to ty1 into the tiles of
+      the given columns and passes them on to onRow, if set.
+    */
+    struct Cutter
+    {
+      RegionDecoder *decoder;
+      const RowHandler *handler;
+      unsigned ty0, ty1;
+      std::vector<unsigned> columns{};
+      std::vector<std::shared_ptr<Tile>> tiles{};
+      unsigned error{0};
+
+      Cutter(RegionDecoder *decoder, const RowHandler *handler, unsigned ty0, unsigned ty1)
+          : decoder(decoder), handler(handler), ty0(ty0), ty1(ty1) {}
+      static unsigned onRow(void *context, unsigned y, const unsigned char *row)
+      {
+        Cutter *cutter = static_cast<Cutter *>(context);
+        RegionDecoder *decoder = cutter->decoder;
+        const RGB *pixels = reinterpret_cast<const RGB *>(row);
+        unsigned ty = y / TILE;
+        if (ty >= cutter->ty0 && ty <= cutter->ty1 && !cutter->columns.empty())
+        {
+          unsigned top = ty * TILE;
+          if (y == top)
+          {
+            cutter->tiles.clear();
+            try
+            {
+              for (unsigned tx : cutter->columns)
+              {
+                cutter->tiles.push_back(std::make_shared<Tile>());
+                cutter->tiles.back()->pixels.resize(size_t(decoder->tileWidth(tx)) * decoder->tileHeight(ty));
+              }
+            }
+            catch (const std::exception &)
+            {
+              return cutter->error = 83;
+            }
+          }
+          for (size_t i = 0; i < cutter->columns.size(); i++)
+          {
+            unsigned tx = cutter->columns[i];
+            unsigned tw = decoder->tileWidth(tx);
+            std::copy(pixels + tx * TILE, pixels + tx * TILE + tw,
+                      cutter->tiles[i]->pixels.begin() + size_t(y - top) * tw);
+          }
+          if (y + 1 == top + decoder->tileHeight(ty))
+          {
+            std::lock_guard<std::mutex> lock(decoder->mutex);
+            for (size_t i = 0; i < cutter->columns.size(); i++)
+              decoder->addTile(cutter->columns[i], ty, cutter->tiles[i]);
+          }
+        }
+        if (cutter->handler)
+          (*cutter->handler)(y, pixels);
+        return 0;
+      }
+    };
+
+    std::vector<unsigned char> png{}; // Signature, IHDR and the IDAT chunks of the file
+    lodepng::State state{};
+    LodePNGRowIndex index;
+    uint width{};
+    uint height{};
+    std::mutex mutex{}; // Guards the tiles
+    std::list<CachedTile> lru{}; // Most recently used first
+    std::map<uint64_t, std::list<CachedTile>::iterator> tiles{};
+    size_t tileBytes{0};
+
+    // Keep what lodepng_decode_row_range() reads of the file, the
+    // palette and the other chunks are in state already
+    unsigned copyImageData(const unsigned char *data, size_t size)
+    {
+      const unsigned char *end = data + size;
+      const unsigned char *iend = end;
+      size_t idat = 0;
+      for (const unsigned char *chunk = data + 33; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk))
+      {
+        size_t length = lodepng_chunk_length(chunk);
+        if (length > size_t(end - chunk) - 12)
+          return 63; // Chunk length too large
+        if (lodepng_chunk_type_equals(chunk, "IEND"))
+        {
+          iend = chunk;
+          break;
+        }
+        if (lodepng_chunk_type_equals(chunk, "IDAT"))
+          idat += length + 12;
+      }
+      try
+      {
+        png.reserve(33 + idat + 12);
+        png.assign(data, data + 33);
+        for (const unsigned char *chunk = data + 33; chunk + 12 <= iend; chunk = lodepng_chunk_next_const(chunk))
+          if (lodepng_chunk_type_equals(chunk, "IDAT"))
+            png.insert(png.end(), chunk, chunk + lodepng_chunk_length(chunk) + 12);
+        static const unsigned char IEND[12] = {0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82};
+        png.insert(png.end(), IEND, IEND + 12);
+      }
+      catch (const std::exception &) // bad_alloc
+      {
+        return 83;
+      }
+      return 0;
+    }
+    unsigned tileWidth(unsigned tx) const
+    {
+      return std::min(unsigned(TILE), width - tx * TILE);
+    }
+    unsigned tileHeight(unsigned ty) const
+    {
+      return std::min(unsigned(TILE), height - ty * TILE);
+    }
+    // The part of the image under the select box, at most MAX_REGION_PIXELS.
+    // Like RGBData, the box covers the rows y to y + h.
+    Image::Region clip(const Rect &box) const
+    {
+      Image::Region area{};
+      area.x = clamp(int(std::round(box.x)), 0, int(width) - 1);
+      area.y = clamp(int(std::round(box.y)), 0, int(height) - 1);
+      area.width = clamp(int(std::round(box.w)), 1, int(width - area.x));
+      area.height = clamp(int(std::round(box.h)) + 1, 1, int(height - area.y));
+      size_t maxPixels = MAX_REGION_PIXELS;
+      area.width = std::min<size_t>(area.width, maxPixels);
+      area.height = std::min<size_t>(area.height, maxPixels / area.width);
+      return area;
+    }
+    static uint64_t tileKey(unsigned tx, unsigned ty)
+    {
+      return uint64_t(ty) << 32 | tx;
+    }
+    // Both with the mutex locked
+    std::shared_ptr<const Tile> findTile(unsigned tx, unsigned ty)
+    {
+      auto it = tiles.find(tileKey(tx, ty));
+      if (it == tiles.end())
+        return nullptr;
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->tile;
+    }
+    void addTile(unsigned tx, unsigned ty, std::shared_ptr<const Tile> tile)
+    {
+      uint64_t key = tileKey(tx, ty);
+      if (tiles.count(key)) // Decoded by another thread meanwhile
+        return;
+      lru.push_front(CachedTile{key, tile});
+      tiles[key] = lru.begin();
+      tileBytes += tile->pixels.size() * sizeof(RGB);
+      while (tileBytes > TILE_BUDGET && lru.size() > 1)
+      {
+        tileBytes -= lru.back().tile->pixels.size() * sizeof(RGB);
+        tiles.erase(lru.back().key);
+        lru.pop_back();
+      }
+    }
+  };
+};
@@ -0,0 +1,367 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "pictogramtools.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <random>
+
+namespace thm
+{
+  // How the loader lays out the ScanPath of a module
+  struct ScanSettings
+  {
+    int order;
+    uint32_t seed;    // For SCAN_RANDOM
+    unsigned rowStep; // Rows read side by side, the path visits every rowStep-th row
+    bool sums;        // Build the summed-area tables, for averaging
+    int waves;        // Build the wave bank, see WaveSource
+  };
+
+  /*
+    Lays out the cells of a width x height grid in one of the scan
+    orders. The grid is the select box, or every rowStep-th row of it.
+  */
+  struct ScanGrid
+  {
+    unsigned width, height;
+    std::vector<uint32_t> cells{}; // y * width + x, in scan order
+
+    ScanGrid(unsigned width, unsigned height) : width(width), height(height)
+    {
+      cells.reserve(size_t(width) * height);
+    }
+    void build(int order, uint32_t seed)
+    {
+      switch (order)
+      {
+      case SCAN_SNAKE:
+        for (unsigned y = 0; y < height; y++)
+          for (unsigned x = 0; x < width; x++)
+            add(y % 2 ? width - 1 - x : x, y);
+        break;
+      case SCAN_COLUMNS:
+        for (unsigned x = 0; x < width; x++)
+          for (unsigned y = 0; y < height; y++)
+            add(x, y);
+        break;
+      case SCAN_SPIRAL:
+        spiral();
+        break;
+      case SCAN_HILBERT:
+        if (width >= height)
+          hilbert(0, 0, width, 0, 0, height);
+        else
+          hilbert(0, 0, 0, height, width, 0);
+        break;
+      case SCAN_DIAGONAL:
+        for (unsigned d = 0; d + 1 < width + height; d++)
+          for (unsigned x = d < height ? 0 : d - height + 1; x <= std::min(d, width - 1); x++)
+            add(x, d - x);
+        break;
+      case SCAN_RANDOM:
+        build(SCAN_ROWS, seed);
+        shuffle(seed);
+        break;
+      default:
+        for (unsigned y = 0; y < height; y++)
+          for (unsigned x = 0; x < width; x++)
+            add(x, y);
+      }
+    }
+
+  private:
+    void add(int x, int y)
+    {
+      cells.push_back(uint32_t(y) * width + x);
+    }
+    void spiral()
+    {
+      int left = 0, top = 0;
+      int right = width - 1, bottom = height - 1;
+      while (left <= right && top <= bottom)
+      {
+        for (int x = left; x <= right; x++)
+          add(x, top);
+        for (int y = top + 1; y <= bottom; y++)
+          add(right, y);
+        if (top < bottom)
+          for (int x = right - 1; x >= left; x--)
+            add(x, bottom);
+        if (left < right)
+          for (int y = bottom - 1; y > top; y--)
+            add(left, y);
+        left++, top++, right--, bottom--;
+      }
+    }
+    static int sign(int v)
+    {
+      return (v > 0) - (v < 0);
+    }
+    // Halves rounded down, also for negative values
+    static int half(int v)
+    {
+      return v >= 0 ? v / 2 : -((1 - v) / 2);
+    }
+    /*
+      Generalized Hilbert curve (after J. Cervený's gilbert2d), fills
+      rectangles of any size. Walks the block at x, y along the major
+      axis a, rows stacked along the minor axis b.
+    */
+    void hilbert(int x, int y, int ax, int ay, int bx, int by)
+    {
+      int w = std::abs(ax + ay);
+      int h = std::abs(bx + by);
+      int dax = sign(ax), day = sign(ay);
+      int dbx = sign(bx), dby = sign(by);
+      if (h == 1)
+      {
+        for (int i = 0; i < w; i++, x += dax, y += day)
+          add(x, y);
+        return;
+      }
+      if (w == 1)
+      {
+        for (int i = 0; i < h; i++, x += dbx, y += dby)
+          add(x, y);
+        return;
+      }
+      int ax2 = half(ax), ay2 = half(ay);
+      int bx2 = half(bx), by2 = half(by);
+      int w2 = std::abs(ax2 + ay2);
+      int h2 = std::abs(bx2 + by2);
+      if (2 * w > 3 * h)
+      {
+        // Long block, split it in two along the major axis
+        if (w2 % 2 && w > 2)
+          ax2 += dax, ay2 += day;
+        hilbert(x, y, ax2, ay2, bx, by);
+        hilbert(x + ax2, y + ay2, ax - ax2, ay - ay2, bx, by);
+      }
+      else
+      {
+        // Up the minor axis, along the major one and back down
+        if (h2 % 2 && h > 2)
+          bx2 += dbx, by2 += dby;
+        hilbert(x, y, bx2, by2, ax2, ay2);
+        hilbert(x + bx2, y + by2, ax, ay, bx - bx2, by - by2);
+        hilbert(x + (ax - dax) + (bx2 - dbx), y + (ay - day) + (by2 - dby),
+                -bx2, -by2, -(ax - ax2), -(ay - ay2));
+      }
+    }
+    // Fisher-Yates. mt19937 yields the same numbers everywhere, so a
+    // saved patch plays the same order on every machine.
+    void shuffle(uint32_t seed)
+    {
+      std::mt19937 rng(seed);
+      for (size_t i = cells.size(); i > 1; i--)
+      {
+        size_t j = size_t((uint64_t(rng()) * i) >> 32);
+        std::swap(cells[i - 1], cells[j]);
+      }
+    }
+  };
+
+  // What the wave bank of an oscillator is made of
+  enum WaveSource
+  {
+    WAVES_OFF,
+    WAVES_ROWS,
+    WAVES_COLUMNS,
+    WAVE_SOURCES_LEN
+  };
+
+  /*
+    Fill the wave bank of a path: up to MAX_WAVES rows or columns of the
+    box, evenly spread, each stretched to one cycle and band-limited in
+    the spectrum for every level. One plane per task.
+  */
+  inline bool buildWaves(ScanPath &path, int source)
+  {
+    const uint size = ScanPath::WAVE_SIZE;
+    bool columns = source == WAVES_COLUMNS;
+    uint lines = columns ? path.columns : path.rows;
+    uint length = columns ? path.rows : path.columns;
+    path.waveCount = std::min<uint>(lines, ScanPath::MAX_WAVES);
+    try
+    {
+      for (std::vector<float> &waves : path.waves)
+        waves.resize(size_t(path.waveCount) * ScanPath::WAVE_LEVELS * size);
+    }
+    catch (const std::exception &) // bad_alloc
+    {
+      for (std::vector<float> &waves : path.waves)
+        std::vector<float>().swap(waves);
+      path.waveCount = 0;
+      return false;
+    }
+    WorkerPool::instance().parallelFor(Image::PLANES, [&](size_t p) {
+      dsp::RealFFT fft(size);
+      std::vector<float> cycle(size), spectrum(size), level(size);
+      const float *plane = path.image->planes[p].data();
+      size_t origin = size_t(path.top) * path.width + path.left;
+      size_t step = columns ? path.width : 1;
+      for (uint w = 0; w < path.waveCount; w++)
+      {
+        // Pixels of the line, linear in between, wrapping to the start
+        uint line = path.waveCount > 1 ? w * (lines - 1) / (path.waveCount - 1) : 0;
+        const float *in = plane + origin + (columns ? line : size_t(line) * path.width);
+        for (uint i = 0; i < size; i++)
+        {
+          float x = float(i) * length / size;
+          uint x0 = uint(x);
+          uint x1 = x0 + 1 < length ? x0 + 1 : 0;
+          cycle[i] = in[x0 * step] + (x - x0) * (in[x1 * step] - in[x0 * step]);
+        }
+        fft.rfft(cycle.data(), spectrum.data());
+        fft.scale(spectrum.data());
+        float *out = path.waves[p].data() + size_t(w) * ScanPath::WAVE_LEVELS * size;
+        for (int l = 0; l < ScanPath::WAVE_LEVELS; l++)
+        {
+          // Ordered spectrum: DC, Nyquist, then re and im of each harmonic
+          uint harmonics = ScanPath::WAVE_HARMONICS >> l;
+          std::copy(spectrum.begin(), spectrum.end(), level.begin());
+          level[1] = 0.f;
+          std::fill(level.begin() + std::min(2 * (harmonics + 1), size), level.end(), 0.f);
+          fft.irfft(level.data(), out + l * size);
+        }
+      }
+    });
+    return true;
+  }
+
+  // Fill the summed-area tables of a path, one plane per task
+  inline bool buildSums(ScanPath &path)
+  {
+    size_t stride = path.columns + 1;
+    // 16 bit images keep their precision as far as the box allows
+    if (path.image->bits > 8)
+      path.sumSteps = std::min<size_t>(std::max<size_t>(UINT32_MAX / (size_t(path.columns) * path.rows), 255), 65535);
+    try
+    {
+      for (std::vector<uint32_t> &sum : path.sums)
+        sum.assign(stride * (path.rows + 1), 0);
+    }
+    catch (const std::exception &) // bad_alloc
+    {
+      for (std::vector<uint32_t> &sum : path.sums)
+        std::vector<uint32_t>().swap(sum);
+      return false;
+    }
+    WorkerPool::instance().parallelFor(Image::PLANES, [&](size_t p) {
+      const float *plane = path.image->planes[p].data();
+      uint32_t *sum = path.sums[p].data();
+      float steps = path.sumSteps;
+      for (uint y = 0; y < path.rows; y++)
+      {
+        const float *in = plane + size_t(path.top + y) * path.width + path.left;
+        uint32_t *above = sum + y * stride;
+        uint32_t *out = above + stride;
+        uint32_t row = 0;
+        for (uint x = 0; x < path.columns; x++)
+        {
+          row += uint32_t(in[x] * steps + 0.5f);
+          out[x + 1] = above[x + 1] + row;
+        }
+      }
+    });
+    return true;
+  }
+
+  /*
+    The scan path over the part of the select box the image holds,
+    nullptr if the box misses it. Runs on the loader thread.
+  */
+  inline std::shared_ptr<const ScanPath> buildScanPath(std::shared_ptr<const Image> image, const Rect &box,
+                                                       const ScanSettings &settings)
+  {
+    // The select box cut to the pixels the image holds, in their coordinates
+    const Image::Region &area = image->region;
+    int left = std::max<int>(std::round(box.x), area.x);
+    int top = std::max<int>(std::round(box.y), area.y);
+    int right = std::min<int>(std::round(box.x) + std::round(box.w), area.x + area.width);
+    int bottom = std::min<int>(std::round(box.y) + std::round(box.h), int(area.y + area.height) - 1);
+    if (right <= left || bottom < top)
+      return nullptr;
+    unsigned rows = bottom - top + 1;
+    unsigned step = std::max(1u, settings.rowStep);
+    std::shared_ptr<ScanPath> path = std::make_shared<ScanPath>();
+    path->image = image;
+    path->width = area.width;
+    path->left = left - area.x;
+    path->top = top - area.y;
+    path->columns = right - left;
+    path->rows = rows;
+    try
+    {
+      // Grid cell x, y is the pixel x, y * step of the box
+      ScanGrid grid(right - left, (rows + step - 1) / step);
+      grid.build(settings.order, settings.seed);
+      path->order.resize(grid.cells.size());
+      uint32_t origin = path->top * area.width + path->left;
+      for (size_t i = 0; i < grid.cells.size(); i++)
+      {
+        uint32_t x = grid.cells[i] % grid.width;
+        uint32_t y = grid.cells[i] / grid.width;
+        path->order[i] = origin + y * step * area.width + x;
+      }
+    }
+    catch (const std::exception &) // bad_alloc
+    {
+      WARN("Pictogram: no memory for the scan path of a %dx%u box", right - left, rows);
+      return nullptr;
+    }
+    if (settings.sums && !buildSums(*path))
+      WARN("Pictogram: no memory to average a %dx%u box", right - left, rows);
+    if (settings.waves != WAVES_OFF && !buildWaves(*path, settings.waves))
+      WARN("Pictogram: no memory for the waves of a %dx%u box", right - left, rows);
+    return path;
+  }
+
+  /*
+    What the engine gets from the loader: the scan paths over the
+    frames that are decoded, a window of frames first, first + 1, ...
+    wrapping around at count. A still image is a set of one frame.
+    Paths of the same layout share the box and the scan order, so the
+    engine keeps its position when it moves on to the next frame.
+  */
+  struct FrameSet
+  {
+    unsigned count{1};
+    unsigned first{0};
+    unsigned layout{0};
+    std::vector<std::shared_ptr<const ScanPath>> paths{}; // Null while a frame is decoded
+    std::shared_ptr<const std::vector<float>> delays{};   // Seconds per frame, null if the frames do not say
+
+    // The path over frame, or over the first frame of the window if
+    // frame is not decoded (yet)
+    const ScanPath *get(unsigned frame) const
+    {
+      unsigned i = (frame % count + count - first) % count;
+      if (i < paths.size() && paths[i])
+        return paths[i].get();
+      return paths.empty() ? nullptr : paths[0].get();
+    }
+  };
+};
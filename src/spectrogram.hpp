@@ -0,0 +1,143 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include "pictogramtools.hpp"
+#include <cmath>
+#include <random>
+
+namespace thm
+{
+  /*
+    Resynthesis of the select box as a spectrogram: every column is a
+    frame, the rows are the frequency bins from Nyquist at the top down
+    to the lowest bin at the bottom, a plane value is the magnitude.
+    Frames are turned into sound by inverse FFT and Hann windowed
+    overlap-add, one hop of samples at a time, so process() only copies
+    samples out between hops. Each plane sounds on its own output.
+  */
+  struct SpectralSynth
+  {
+    enum { SIZE = 1024, HOP = SIZE / 4, BINS = SIZE / 2 };
+
+    SpectralSynth() : fft(SIZE)
+    {
+      for (int i = 0; i < SIZE; i++)
+        window[i] = 0.5f - 0.5f * std::cos(2.f * float(M_PI) * i / SIZE);
+      // Bins start at random phases, so a new frame does not click
+      std::mt19937 rng(1);
+      std::uniform_real_distribution<float> phase(0.f, 2.f * float(M_PI));
+      rotors[0] = rotors[1] = 0.f;
+      for (int k = 1; k < BINS; k++)
+      {
+        float p = phase(rng);
+        rotors[2 * k] = std::cos(p);
+        rotors[2 * k + 1] = std::sin(p);
+      }
+      for (std::vector<float> &sum : sums)
+        sum.assign(SIZE, 0.f);
+    }
+    void reset()
+    {
+      frame = 0.f;
+    }
+    // Move on by frames columns, the clock does so one at a time
+    void advance(float frames)
+    {
+      frame += frames;
+    }
+    // One sample of every plane. Synthesizes the next hop when the
+    // samples of the current one are used up.
+    void process(const ScanPath &path, float values[Image::PLANES])
+    {
+      if (pos == HOP)
+      {
+        synthesize(path);
+        pos = 0;
+      }
+      for (int p = 0; p < Image::PLANES; p++)
+        values[p] = sums[p][pos];
+      pos++;
+    }
+
+  private:
+    dsp::RealFFT fft;
+    float window[SIZE];
+    // Phase of every bin as cos and sin, in the ordered layout of
+    // dsp::RealFFT: DC, Nyquist, then re and im of each bin
+    alignas(16) float rotors[SIZE];
+    alignas(16) float spectrum[SIZE];
+    alignas(16) float magnitudes[SIZE];
+    alignas(16) float samples[SIZE];
+    std::vector<float> sums[Image::PLANES]; // Overlap-add, the first hop is output
+    float frame{0.f};
+    int pos{HOP};
+
+    void synthesize(const ScanPath &path)
+    {
+      using simd::float_4;
+      frame = std::fmod(frame, float(path.columns));
+      const uint column = std::min(uint(frame), path.columns - 1);
+      // A bin centred sine turns by k * HOP / SIZE cycles, a quarter
+      // turn per bin index, from one hop to the next
+      for (int k = 1; k < BINS; k++)
+        for (int q = 0; q < (k & 3); q++)
+        {
+          float c = rotors[2 * k];
+          rotors[2 * k] = -rotors[2 * k + 1];
+          rotors[2 * k + 1] = c;
+        }
+      for (int p = 0; p < Image::PLANES; p++)
+      {
+        // Magnitudes of the column, rows read linearly in between
+        const float *plane = path.image->planes[p].data() + size_t(path.top) * path.width + path.left + column;
+        float energy = 0.f;
+        magnitudes[0] = magnitudes[1] = 0.f;
+        for (int k = 1; k < BINS; k++)
+        {
+          float row = (1.f - float(k) / BINS) * (path.rows - 1);
+          uint r0 = uint(row);
+          uint r1 = std::min(r0 + 1, path.rows - 1);
+          float a = plane[size_t(r0) * path.width], b = plane[size_t(r1) * path.width];
+          float m = a + (row - r0) * (b - a);
+          magnitudes[2 * k] = magnitudes[2 * k + 1] = m;
+          energy += m * m;
+        }
+        // As loud as a full scale sine at most, whatever the column holds
+        float_4 gain = 1.f / std::max(1.f, std::sqrt(energy));
+        for (int i = 0; i < SIZE; i += 4)
+          (float_4::load(rotors + i) * float_4::load(magnitudes + i) * gain).store(spectrum + i);
+        fft.irfft(spectrum, samples);
+        // irfft() gives twice the sines of amplitude m, and the four
+        // windows that overlap at every sample sum to 2
+        std::vector<float> &sum = sums[p];
+        std::copy(sum.begin() + HOP, sum.end(), sum.begin());
+        std::fill(sum.end() - HOP, sum.end(), 0.f);
+        float_4 scale = 0.25f;
+        for (int i = 0; i < SIZE; i += 4)
+        {
+          float_4 s = float_4::load(&sum[i]) + float_4::load(samples + i) * float_4::load(window + i) * scale;
+          s.store(&sum[i]);
+        }
+      }
+    }
+  };
+};
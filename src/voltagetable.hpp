@@ -0,0 +1,141 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace thm
+{
+  // Shapes of the outputs, applied on top of scale and offset
+  enum Curve
+  {
+    CURVE_LINEAR,
+    CURVE_EXPONENTIAL,
+    CURVE_SEMITONES,
+    CURVES_LEN
+  };
+
+  // Scales of the quantizer
+  enum Scale
+  {
+    QUANTIZER_OFF = -1,
+    SCALE_CHROMATIC,
+    SCALE_MAJOR,
+    SCALE_MINOR,
+    SCALE_HARMONIC_MINOR,
+    SCALE_DORIAN,
+    SCALE_PENTATONIC_MAJOR,
+    SCALE_PENTATONIC_MINOR,
+    SCALE_WHOLE_TONE,
+    SCALES_LEN
+  };
+
+  // Nearest note of the scale on the key, both at 1V/octave with 0V at C.
+  // Bit n of a mask is the semitone n above the key.
+  inline float quantize(float volts, int scale, int key)
+  {
+    static const uint16_t masks[SCALES_LEN] = {0xfff, 0xab5, 0x5ad, 0x9ad, 0x6ad, 0x295, 0x4a9, 0x555};
+    float semitones = volts * 12.f;
+    int nearest = int(std::round(semitones));
+    int best = nearest;
+    float distance = INFINITY;
+    // Every scale has a note within an octave
+    for (int n = nearest - 12; n <= nearest + 12; n++)
+    {
+      int degree = ((n - key) % 12 + 12) % 12;
+      if ((masks[scale] >> degree & 1) && std::fabs(n - semitones) < distance)
+      {
+        distance = std::fabs(n - semitones);
+        best = n;
+      }
+    }
+    return best / 12.f;
+  }
+
+  /*
+    Plane value to output voltage. The curve is tabulated at the 256
+    values of an 8-bit channel and only rebuilt when the curve or the
+    quantizer change in the menu, never for the knobs: scale and
+    offset are applied after the table, as the gain and bias process()
+    ramps over every control block. Values in between, from 16 bit
+    images, the averaging, the X/Y CV or the hue plane, read between
+    two entries. Stepped curves and the quantizer round that voltage
+    with a second table: notes only change at multiples of half a
+    semitone, so one entry per half semitone from -10V to 10V is exact.
+  */
+  struct VoltageTable
+  {
+    enum { STEPS = 255 };
+    // Half semitones from -10V to 10V
+    enum { BINS_PER_VOLT = 24, FIRST_BIN = -10 * BINS_PER_VOLT, NOTE_BINS = 20 * BINS_PER_VOLT + 2 };
+
+    // Returns true when the table had to be rebuilt
+    bool update(int curve, int quantizer = QUANTIZER_OFF, int key = 0)
+    {
+      if (curve == builtCurve && quantizer == builtQuantizer && key == builtKey)
+        return false;
+      builtCurve = curve;
+      builtQuantizer = quantizer;
+      builtKey = key;
+      stepped = curve == CURVE_SEMITONES || quantizer != QUANTIZER_OFF;
+      for (int i = 0; i <= STEPS; i++)
+      {
+        float value = float(i) / STEPS;
+        if (curve == CURVE_EXPONENTIAL)
+          value = (std::exp2(4.f * value) - 1.f) / 15.f;
+        table[i] = value;
+      }
+      table[STEPS + 1] = table[STEPS];
+      if (!stepped)
+        return true;
+      // The note of every half semitone bin, from its middle
+      for (int b = 0; b < NOTE_BINS; b++)
+      {
+        float volts = (FIRST_BIN + b + 0.5f) / BINS_PER_VOLT;
+        if (curve == CURVE_SEMITONES)
+          volts = std::round(volts * 12.f) / 12.f;
+        if (quantizer != QUANTIZER_OFF)
+          volts = quantize(volts, quantizer, key);
+        notes[b] = volts;
+      }
+      return true;
+    }
+    // Output = curve * gain + bias, gain and bias as in process()
+    float lookup(float value, float gain, float bias) const
+    {
+      float x = std::min(std::max(value, 0.f), 1.f) * STEPS;
+      int i = int(x);
+      float volts = (table[i] + (table[i + 1] - table[i]) * (x - i)) * gain + bias;
+      if (!stepped)
+        return volts;
+      int bin = int(std::floor(volts * BINS_PER_VOLT)) - FIRST_BIN;
+      return notes[std::min(std::max(bin, 0), int(NOTE_BINS) - 1)];
+    }
+
+  private:
+    float table[STEPS + 2]{}; // One spare entry for reading between at 1.0
+    float notes[NOTE_BINS]{};
+    bool stepped{false};
+    int builtCurve{-1}, builtQuantizer{QUANTIZER_OFF}, builtKey{0};
+  };
+};
@@ -0,0 +1,190 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace thm
+{
+  /*
+    Worker threads shared by all Pictogram modules for the parts of
+    decoding that split into independent pieces. The loaders stay one
+    thread per module, so several images still load side by side.
+    A thread that waits for its tasks runs the queued ones itself, so
+    tasks may start tasks of their own, and tasks run even while the
+    pool has no threads.
+    The threads only run while a User holds the pool, one per module,
+    and are joined when the last one lets go. The pool itself is a
+    static that is destroyed when the plugin is unloaded, on Windows
+    under the loader lock, where joining a thread hangs.
+  */
+  struct WorkerPool
+  {
+    static WorkerPool &instance()
+    {
+      static WorkerPool pool;
+      return pool;
+    }
+    // Keeps the threads running for its lifetime
+    struct User
+    {
+      User()
+      {
+        instance().attach();
+      }
+      ~User()
+      {
+        instance().detach();
+      }
+      User(const User &) = delete;
+      User &operator=(const User &) = delete;
+    };
+    // Tasks of one caller. wait() returns when all of them have run.
+    struct Group
+    {
+      Group() = default;
+      Group(const Group &) = delete;
+      Group &operator=(const Group &) = delete;
+      ~Group()
+      {
+        wait();
+      }
+      void run(std::function<void()> task)
+      {
+        WorkerPool &pool = instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pending++;
+        pool.tasks.push_back(Task{this, std::move(task)});
+        pool.cv.notify_one();
+      }
+      void wait()
+      {
+        WorkerPool &pool = instance();
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        while (pending > 0)
+        {
+          auto it = std::find_if(pool.tasks.begin(), pool.tasks.end(),
+                                 [this](const Task &t) { return t.group == this; });
+          if (it == pool.tasks.end())
+          {
+            pool.done.wait(lock);
+            continue;
+          }
+          Task task = std::move(*it);
+          pool.tasks.erase(it);
+          pool.execute(task, lock);
+        }
+      }
+
+    private:
+      friend struct WorkerPool;
+      int pending{0}; // Guarded by the pool mutex
+    };
+    // Run fn(i) for every i in [0, n) on the pool and return when all are done
+    void parallelFor(size_t n, const std::function<void(size_t)> &fn)
+    {
+      Group group;
+      for (size_t i = 1; i < n; i++)
+        group.run([&fn, i]() { fn(i); });
+      if (n > 0)
+        fn(0);
+      group.wait();
+    }
+
+  private:
+    struct Task
+    {
+      Group *group;
+      std::function<void()> fn;
+    };
+    std::mutex mutex{};
+    std::condition_variable cv{};
+    std::condition_variable done{};
+    std::deque<Task> tasks{};
+    bool quit{false};
+    std::mutex usersMutex{}; // Held while threads start or stop
+    int users{0};
+    std::vector<std::thread> threads{};
+
+    WorkerPool() = default;
+    // Users are gone by now. Threads left over are not joined, see above.
+    ~WorkerPool()
+    {
+      for (std::thread &thread : threads)
+        thread.detach();
+    }
+    void attach()
+    {
+      std::lock_guard<std::mutex> lock(usersMutex);
+      if (users++ > 0)
+        return;
+      quit = false;
+      // Leave cores to the engine and the GUI
+      unsigned n = std::max(1u, std::thread::hardware_concurrency() / 2);
+      for (unsigned i = 0; i < n; i++)
+        threads.emplace_back(&WorkerPool::work, this);
+    }
+    void detach()
+    {
+      std::lock_guard<std::mutex> lock(usersMutex);
+      if (--users > 0)
+        return;
+      {
+        std::lock_guard<std::mutex> queueLock(mutex);
+        quit = true;
+      }
+      cv.notify_all();
+      for (std::thread &thread : threads)
+        thread.join();
+      threads.clear();
+    }
+    void work()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!quit)
+      {
+        if (tasks.empty())
+        {
+          cv.wait(lock);
+          continue;
+        }
+        Task task = std::move(tasks.front());
+        tasks.pop_front();
+        execute(task, lock);
+      }
+    }
+    // Runs a task without the lock held
+    void execute(Task &task, std::unique_lock<std::mutex> &lock)
+    {
+      lock.unlock();
+      task.fn();
+      lock.lock();
+      task.group->pending--;
+      done.notify_all();
+    }
+  };
+};
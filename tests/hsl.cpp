@@ -0,0 +1,124 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+/*
+ * Accuracy test of calcHSL, the float_4 path of calcPlanes, against the
+ * scalar ColorSpace::calc for all 2^24 colors of 8 bit RGB.
+ *
+ * Error bound: hue (in turns, the distance around the circle, so 0.99999
+ * and 0 are close) and saturation within 1e-6 of calc, luminance exact.
+ * rcp is good to 12 bits, the Newton step brings the quotients to a few
+ * ulp; 1e-6 keeps them well inside one step of a 16 bit image (1.5e-5).
+ * Greys must have exactly zero hue and saturation.
+ */
+#include "pictogramtools.hpp"
+#include <cstdio>
+
+namespace
+{
+  const double BOUND = 1e-6;
+
+  struct Error
+  {
+    const char *name;
+    long count{0};
+    double hue{0};
+    double sat{0};
+    double lum{0};
+
+    Error(const char *name) : name(name) {}
+
+    void add(double h, double s, double l)
+    {
+      count++;
+      hue = std::max(hue, h);
+      sat = std::max(sat, s);
+      lum = std::max(lum, l);
+    }
+
+    bool print() const
+    {
+      bool ok = hue <= BOUND && sat <= BOUND && lum == 0;
+      printf("%-24s %9ld colors, max error hue %.3g sat %.3g lum %.3g%s\n", name, count, hue, sat, lum,
+             ok ? "" : "  FAILED");
+      return ok;
+    }
+  };
+};
+
+int main()
+{
+  Error all{"all"}, greys{"greys"}, wrap{"hue wrap-around at red"}, ties{"max-channel ties"};
+  long failures = 0;
+  thm::Image image;
+  image.pixels.resize(256 * 256);
+  for (auto &plane : image.planes)
+    plane.resize(image.pixels.size());
+  thm::ColorSpace reference{};
+
+  for (int r = 0; r < 256; r++)
+  {
+    for (size_t i = 0; i < image.pixels.size(); i++)
+      image.pixels[i] = thm::RGB{uint8_t(r), uint8_t(i >> 8), uint8_t(i)};
+    // an odd split, so the tail of calcHSL runs too
+    thm::calcPlanes(image, 0, image.pixels.size() - 3);
+    thm::calcPlanes(image, image.pixels.size() - 3, image.pixels.size());
+
+    for (size_t i = 0; i < image.pixels.size(); i++)
+    {
+      const thm::RGB &c = image.pixels[i];
+      reference.calc(c);
+      float hue = image.planes[thm::Image::HUE][i];
+      float sat = image.planes[thm::Image::SAT][i];
+      float lum = image.planes[thm::Image::LUM][i];
+      double h = std::fabs(reference.hue / 360.0 - hue);
+      h = std::min(h, 1.0 - h);
+      double s = std::fabs(double(reference.sat) - sat);
+      double l = std::fabs(double(reference.lum) - lum);
+      if (!(hue >= 0.f && hue <= 1.f && sat >= 0.f && sat <= 1.f))
+        h = s = 1; // out of range or NaN
+      all.add(h, s, l);
+
+      int max = std::max({c.r, c.g, c.b});
+      bool grey = c.r == c.g && c.g == c.b;
+      if (grey)
+      {
+        if (hue != 0.f || sat != 0.f)
+          h = s = 1;
+        greys.add(h, s, l);
+      }
+      else if (c.r == max && c.g <= c.b)
+        wrap.add(h, s, l);
+      if (!grey && (c.r == max) + (c.g == max) + (c.b == max) > 1)
+        ties.add(h, s, l);
+      if ((h > BOUND || s > BOUND || l != 0) && ++failures <= 10)
+        printf("MISMATCH rgb %d %d %d: hue %.9g (%.9g) sat %.9g (%.9g) lum %.9g (%.9g)\n", c.r, c.g, c.b, hue,
+               reference.hue / 360.0, sat, reference.sat, lum, reference.lum);
+    }
+  }
+
+  printf("bound: hue and sat %g, lum exact\n", BOUND);
+  bool ok = all.print();
+  ok &= greys.print();
+  ok &= wrap.print();
+  ok &= ties.print();
+  return ok ? 0 : 1;
+}
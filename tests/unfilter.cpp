@@ -0,0 +1,154 @@
+//=======================================================================
+/*
+ *               Copyright (C) 2021 Thomas Michels
+ *
+ *                  GNU GENERAL PUBLIC LICENSE
+ *                  Version 3, 29 June 2007
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//=======================================================================
+/*
+ * Bit-exact test of the SIMD unfilter kernels in lodepng against the scalar
+ * code, for every filter type, the bytewidths of all 8 and 16 bit color types,
+ * odd lengths, in place and with no previous scanline. The kernels are static,
+ * so lodepng.cpp is compiled into the test. Build it for every instruction set
+ * it should cover, see the Makefile.
+ */
+#include "../src/dep/lodepng/lodepng.cpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+  struct Random
+  {
+    uint32_t state{0x12345678u};
+
+    unsigned char next()
+    {
+      state = state * 1664525u + 1013904223u;
+      return (unsigned char)(state >> 24);
+    }
+  };
+
+  enum Pattern { NOISE, EXTREMES };
+
+  /* 0 and 255 make Paeth ties and Avg carries, noise the rest */
+  void fill(std::vector<unsigned char> &v, Pattern pattern, Random &random)
+  {
+    for (auto &c : v)
+      c = pattern == NOISE ? random.next() : (random.next() & 1 ? 255 : 0);
+  }
+
+  typedef void (*UpKernel)(unsigned char*, const unsigned char*, const unsigned char*, size_t);
+
+  struct Test
+  {
+    Random random;
+    long cases{0};
+    long simd{0};
+    long failures{0};
+
+    void fail(const char *kernel, int filterType, size_t bytewidth, size_t length, bool prev, bool inPlace)
+    {
+      if (++failures <= 10)
+        printf("MISMATCH %s filter %d bytewidth %u length %u%s%s\n", kernel, filterType,
+               (unsigned)bytewidth, (unsigned)length, prev ? "" : " first row", inPlace ? " in place" : "");
+    }
+
+    void run(int filterType, size_t bytewidth, size_t length, bool prev, bool inPlace, Pattern pattern)
+    {
+      std::vector<unsigned char> scanline(length), precon(length), expected(length), recon(length);
+      fill(scanline, pattern, random);
+      fill(precon, pattern, random);
+      const unsigned char *p = prev ? precon.data() : nullptr;
+      cases++;
+
+      unfilterScanlineScalar(expected.data(), scanline.data(), p, bytewidth, (unsigned char)filterType, length);
+      if (inPlace)
+        recon = scanline;
+      if (unfilterScanlineSIMD(recon.data(), inPlace ? recon.data() : scanline.data(), p, bytewidth,
+                               (unsigned char)filterType, length))
+      {
+        simd++;
+        if (recon != expected)
+          fail("dispatch", filterType, bytewidth, length, prev, inPlace);
+      }
+
+#ifdef LODEPNG_SIMD_AVX2
+      // the dispatch takes AVX2 for Up when the CPU has it, test SSE2 too
+      if (filterType == 2 && prev)
+      {
+        up("sse2", unfilterUp_sse2, scanline, p, expected, inPlace);
+        if (lodepng_cpu_has_avx2())
+          up("avx2", unfilterUp_avx2, scanline, p, expected, inPlace);
+      }
+#endif
+    }
+
+    void up(const char *kernel, UpKernel unfilterUp, const std::vector<unsigned char> &scanline,
+            const unsigned char *precon, const std::vector<unsigned char> &expected, bool inPlace)
+    {
+      std::vector<unsigned char> recon(scanline.size());
+      if (inPlace)
+        recon = scanline;
+      unfilterUp(recon.data(), inPlace ? recon.data() : scanline.data(), precon, scanline.size());
+      if (recon != expected)
+        fail(kernel, 2, 1, scanline.size(), true, inPlace);
+    }
+  };
+};
+
+int main()
+{
+  printf("kernels:");
+#ifdef LODEPNG_SIMD_SSE2
+  printf(" SSE2");
+#endif
+#ifdef __SSSE3__
+  printf(" SSSE3");
+#endif
+#ifdef __SSE4_1__
+  printf(" SSE4.1");
+#endif
+#ifdef LODEPNG_SIMD_AVX2
+  printf(lodepng_cpu_has_avx2() ? " AVX2" : " (AVX2 compiled, not supported by this CPU)");
+#endif
+#ifdef LODEPNG_SIMD_NEON
+  printf(" NEON");
+#endif
+#if !defined(LODEPNG_SIMD_SSE2) && !defined(LODEPNG_SIMD_NEON)
+  printf(" none");
+#endif
+  printf("\n");
+
+  static const size_t bytewidths[] = {1, 2, 3, 4, 6, 8};
+  Test test;
+  for (int filterType = 0; filterType <= 4; filterType++)
+    for (size_t bytewidth : bytewidths)
+      for (size_t pixels = 1; pixels <= 72; pixels++)
+        for (int flags = 0; flags < 4; flags++)
+          for (int pattern = NOISE; pattern <= EXTREMES; pattern++)
+          {
+            bool prev = flags & 1, inPlace = flags & 2;
+            // short rows around the vector widths and long ones with odd pixel counts
+            test.run(filterType, bytewidth, pixels * bytewidth, prev, inPlace, (Pattern)pattern);
+            test.run(filterType, bytewidth, (1001 + pixels % 8) * bytewidth, prev, inPlace, (Pattern)pattern);
+          }
+
+  printf("%ld cases, %ld by SIMD, %ld mismatches\n", test.cases, test.simd, test.failures);
+  return test.failures ? 1 : 0;
+}